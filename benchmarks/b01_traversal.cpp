@@ -0,0 +1,103 @@
+/******
+st_tree: A highly configurable C++ template tree class, using STL style interfaces.
+
+Copyright (c) 2010-2011 Erik Erlandson
+
+Author:  Erik Erlandson <erikerlandson@yahoo.com>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+******/
+
+// Compares the cost per node of walking a whole tree with each traversal: the
+// breadth-first and depth-first iterators, and the visit() walker.
+//
+// usage: b01_traversal [nodes] [fanout] [repeats]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "st_tree.h"
+using namespace st_tree;
+
+typedef tree<int> tree_t;
+
+// builds a tree of n nodes where every node gets up to 'fanout' children, level by level
+void build(tree_t& t, size_t n, size_t fanout) {
+    t.insert(0);
+    size_t count = 1;
+    for (tree_t::bf_iterator j(t.bf_begin());  (j != t.bf_end()) && (count < n);  ++j) {
+        for (size_t k = 0;  (k < fanout) && (count < n);  ++k, ++count) j->insert(int(count));
+    }
+}
+
+struct sum_visitor {
+    long sum;
+    sum_visitor() : sum(0) {}
+    void enter(const tree_t::node_type& n, size_t) { sum += n.data(); }
+    void exit(const tree_t::node_type&, size_t) {}
+};
+
+template <typename Walk>
+void run(const char* name, const tree_t& t, size_t repeats, Walk walk) {
+    long sum = 0;
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    for (size_t r = 0;  r < repeats;  ++r) sum += walk(t);
+    std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / double(repeats * t.size());
+    std::printf("%-16s %8.2f ns/node   (checksum %ld)\n", name, ns, sum);
+}
+
+int main(int argc, char** argv) {
+    size_t n = (argc > 1) ? std::strtoul(argv[1], NULL, 10) : 1000000;
+    size_t fanout = (argc > 2) ? std::strtoul(argv[2], NULL, 10) : 4;
+    size_t repeats = (argc > 3) ? std::strtoul(argv[3], NULL, 10) : 10;
+
+    tree_t t;
+    build(t, n, fanout);
+    std::printf("nodes: %lu   fanout: %lu   depth: %lu   repeats: %lu\n",
+                (unsigned long)t.size(), (unsigned long)fanout, (unsigned long)t.depth(), (unsigned long)repeats);
+
+    run("bf_iterator", t, repeats, [](const tree_t& t) {
+        long s = 0;
+        for (tree_t::const_bf_iterator j(t.bf_begin());  j != t.bf_end();  ++j) s += j->data();
+        return s;
+    });
+
+    tree_t::traversal_context ctx;
+    run("bf_iterator+ctx", t, repeats, [&ctx](const tree_t& t) {
+        long s = 0;
+        for (tree_t::const_bf_iterator j(t.bf_begin(ctx));  j != t.bf_end();  ++j) s += j->data();
+        return s;
+    });
+
+    run("df_pre_iterator", t, repeats, [](const tree_t& t) {
+        long s = 0;
+        for (tree_t::const_df_pre_iterator j(t.df_pre_begin());  j != t.df_pre_end();  ++j) s += j->data();
+        return s;
+    });
+
+    run("df_post_iterator", t, repeats, [](const tree_t& t) {
+        long s = 0;
+        for (tree_t::const_df_post_iterator j(t.df_post_begin());  j != t.df_post_end();  ++j) s += j->data();
+        return s;
+    });
+
+    run("visit", t, repeats, [](const tree_t& t) {
+        sum_visitor v;
+        visit(t, v);
+        return v.sum;
+    });
+
+    return 0;
+}
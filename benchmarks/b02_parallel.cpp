@@ -0,0 +1,99 @@
+/******
+st_tree: A highly configurable C++ template tree class, using STL style interfaces.
+
+Copyright (c) 2010-2011 Erik Erlandson
+
+Author:  Erik Erlandson <erikerlandson@yahoo.com>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+******/
+
+// Measures how parallel_for_each and parallel_fold scale with thread count, on a wide
+// tree whose per-node work is a small CPU-bound loop, and how tree::copy_from scales.
+//
+// usage: b02_parallel [nodes] [fanout] [work]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include "st_tree_parallel.h"
+using namespace st_tree;
+
+typedef tree<double> tree_t;
+
+void build(tree_t& t, size_t n, size_t fanout) {
+    t.insert(0);
+    size_t count = 1;
+    for (tree_t::bf_iterator j(t.bf_begin());  (j != t.bf_end()) && (count < n);  ++j) {
+        for (size_t k = 0;  (k < fanout) && (count < n);  ++k, ++count) j->insert(double(count));
+    }
+}
+
+// a deliberately CPU-bound score for one node
+double score(double x, size_t work) {
+    double s = x;
+    for (size_t j = 0;  j < work;  ++j) s = std::sqrt(s + 1.0);
+    return s;
+}
+
+template <typename Run>
+double seconds(Run run) {
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    run();
+    std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(t1 - t0).count();
+}
+
+int main(int argc, char** argv) {
+    size_t n = (argc > 1) ? std::strtoul(argv[1], NULL, 10) : 1000000;
+    size_t fanout = (argc > 2) ? std::strtoul(argv[2], NULL, 10) : 8;
+    size_t work = (argc > 3) ? std::strtoul(argv[3], NULL, 10) : 50;
+
+    tree_t t;
+    build(t, n, fanout);
+    size_t hw = std::thread::hardware_concurrency();
+    if (hw == 0) hw = 1;
+    std::printf("nodes: %lu   fanout: %lu   work: %lu   hardware threads: %lu\n",
+                (unsigned long)t.size(), (unsigned long)fanout, (unsigned long)work, (unsigned long)hw);
+
+    double base_each = 0, base_fold = 0, base_copy = 0;
+    for (size_t threads = 1;  threads <= hw;  threads *= 2) {
+        parallel_policy policy(threads);
+        double each = seconds([&]() {
+            parallel_for_each(t, [work](tree_t::node_type& q) { q.data() = score(q.data(), work); }, policy);
+        });
+        double total = 0;
+        double fold = seconds([&]() {
+            total = parallel_fold(t, [work](const tree_t::node_type& q) { return score(q.data(), work); },
+                                  [work](const tree_t::node_type& q, double* first, double* last) {
+                                      double s = score(q.data(), work);
+                                      for (;  first != last;  ++first) s += *first;
+                                      return s;
+                                  }, policy);
+        });
+        tree_t c;
+        double copy = seconds([&]() { c.copy_from(t, policy); });
+        if (threads == 1) {
+            base_each = each;
+            base_fold = fold;
+            base_copy = copy;
+        }
+        std::printf("threads %3lu   for_each %8.3f s (x%5.2f)   fold %8.3f s (x%5.2f)   copy %8.3f s (x%5.2f)   (checksum %g)\n",
+                    (unsigned long)threads, each, base_each / each, fold, base_fold / fold, copy, base_copy / copy, total);
+    }
+
+    return 0;
+}
@@ -22,6 +22,7 @@ limitations under the License.
 #define __st_tree_h__ 1
 
 
+#include <atomic>
 #include <string>
 #include <exception>
 
@@ -45,6 +46,16 @@ template <typename Key, typename Compare = std::less<Key> >
 struct keyed {};
 
 
+// Bookkeeping policy: which per-node statistics are maintained as the tree changes.
+// An untracked statistic costs no storage and no work on insert/erase, and
+// subtree_size() or depth() then compute it on demand by walking the subtree.
+template <bool Size = true, bool Depth = true>
+struct tracking {
+    static const bool size = Size;
+    static const bool depth = Depth;
+};
+
+
 // generic exception base class for tree package
 struct exception: public std::exception {
     exception() throw(): std::exception(), _what() {}
@@ -101,6 +112,10 @@ struct missing_exception: public exception {
 #include "st_tree_iterators.h"
 #endif
 
+#if !defined(__st_tree_pool_h__)
+#include "st_tree_pool.h"
+#endif
+
 #if !defined(__st_tree_nodes_h__)
 #include "st_tree_nodes.h"
 #endif
@@ -108,12 +123,18 @@ struct missing_exception: public exception {
 
 namespace st_tree {
 
-template <typename Data, typename CSModel, typename Alloc>
+// defined in st_tree_parallel.h
+struct parallel_policy;
+
+template <typename Tree> struct tree_builder;
+
+template <typename Data, typename CSModel, typename Alloc, typename Tracking>
 struct tree {
-    typedef tree<Data, CSModel, Alloc> tree_type;
+    typedef tree<Data, CSModel, Alloc, Tracking> tree_type;
     typedef Data data_type;
     typedef CSModel cs_model_type;
     typedef Alloc allocator_type;
+    typedef Tracking tracking_type;
     typedef size_t size_type;
     typedef st_tree::detail::difference_type difference_type;
 
@@ -122,8 +143,8 @@ struct tree {
 
     public:
     typedef typename nt_dispatch::node_type node_type;
-    typedef typename std::allocator<node_type> node_allocator_type;
-    typedef typename std::allocator<typename nt_dispatch::cs_value_type> cs_allocator_type;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<node_type> node_allocator_type;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<typename nt_dispatch::cs_value_type> cs_allocator_type;
 
     protected:
     typedef typename node_type::base_type node_base_type;
@@ -143,19 +164,41 @@ struct tree {
     typedef typename node_type::const_df_post_iterator const_df_post_iterator;
     typedef typename node_type::df_pre_iterator df_pre_iterator;
     typedef typename node_type::const_df_pre_iterator const_df_pre_iterator;
+    typedef typename node_type::traversal_context traversal_context;
+
 
+    tree() : _root(NULL), _node_allocator(), _deferred(NULL), _defer(false), _batch(0) { pool_dispatch::attach(_node_allocator); }
+    virtual ~tree() {
+        clear();
+        flush();
+        pool_dispatch::detach(_node_allocator);
+    }
 
-    tree() : _root(NULL), _node_allocator() {}
-    virtual ~tree() { clear(); }
+    tree(const tree& src) : _root(NULL), _node_allocator(node_alloc_traits::select_on_container_copy_construction(src._node_allocator)), _deferred(NULL), _defer(false), _batch(0) {
+        pool_dispatch::attach(_node_allocator);
+        *this = src;
+    }
 
-    tree(const tree& src) : _root(NULL) { *this = src; }
+    // takes over the nodes of src, leaving it empty
+    tree(tree&& src) : _root(src._root), _node_allocator(std::move(src._node_allocator)), _deferred(NULL), _defer(false), _batch(0) {
+        pool_dispatch::attach(_node_allocator);
+        src._root = NULL;
+        if (!empty()) _root->_tree = this;
+        _settle();
+    }
 
-    tree(const node_allocator_type& a) : _root(NULL), _node_allocator(a) {}
+    tree(const node_allocator_type& a) : _root(NULL), _node_allocator(a), _deferred(NULL), _defer(false), _batch(0) { pool_dispatch::attach(_node_allocator); }
+    tree(const allocator_type& a) : _root(NULL), _node_allocator(a), _deferred(NULL), _defer(false), _batch(0) { pool_dispatch::attach(_node_allocator); }
 
     tree& operator=(const tree& src) {
         if (&src == this) return *this;
 
-        _node_allocator = src._node_allocator;
+        // nodes must be released by the allocator that created them
+        if (node_alloc_traits::propagate_on_container_copy_assignment::value) {
+            clear();
+            flush();
+            _node_allocator = src._node_allocator;
+        }
 
         if (src.empty()) {
             clear();
@@ -165,7 +208,6 @@ struct tree {
         if (empty()) {
             _root = _new_node();
             _root->_tree = this;
-            _root->_depth.insert(1);
         }
 
         *_root = src.root();
@@ -173,6 +215,33 @@ struct tree {
         return *this;
     }
 
+    tree& operator=(tree&& src) {
+        if (&src == this) return *this;
+
+        // nodes can only be taken over if this tree's allocator is able to release them
+        if (!node_alloc_traits::propagate_on_container_move_assignment::value && (_node_allocator != src._node_allocator)) {
+            *this = static_cast<const tree&>(src);
+            src.clear();
+            return *this;
+        }
+
+        clear();
+        if (node_alloc_traits::propagate_on_container_move_assignment::value) {
+            flush();
+            pool_dispatch::detach(_node_allocator);
+            _node_allocator = src._node_allocator;
+            pool_dispatch::attach(_node_allocator);
+        }
+        _root = src._root;
+        src._root = NULL;
+        if (!empty()) _root->_tree = this;
+        if (0 == _batch) _settle();
+
+        return *this;
+    }
+
+
+    allocator_type get_allocator() const { return allocator_type(_node_allocator); }
 
     bool empty() const { return _root == NULL; }
     size_type size() const { return (empty()) ? 0 : root().subtree_size(); }
@@ -191,29 +260,70 @@ struct tree {
     template< class... Args >
     void emplace( Args&&... args ){
         clear();
-        _root = _new_node();
-        _root->_data = data_type(std::forward<Args>(args) ... );
+        _root = _new_node(std::forward<Args>(args)...);
         _root->_tree = this;
-        _root->_depth.insert(1);
     }
 
     void insert(const data_type& data) { emplace(data); };
+    void insert(data_type&& data) { emplace(std::move(data)); };
 
     // there is only one node to erase from the tree: the root
     void erase() { clear(); }
 
     void clear() {
         if (empty()) return;
-        _delete_node(_root);
+        node_type* r = _root;
         _root = NULL;
+        if (_defer) {
+            _reclaim(r);
+            return;
+        }
+        // a private node pool can drop the entire tree at once, when no destructors need to run
+        if (!node_type::_trivial_teardown() || !pool_dispatch::release(_node_allocator, r->subtree_size())) _delete_node(r);
+    }
+
+    // Erased subtrees are normally released before erase() or clear() returns.  While
+    // reclamation is deferred they are only unlinked, and queued until flush() is called,
+    // or the tree is destroyed, so that a large erase costs its caller O(depth).
+    void defer_reclamation(bool defer = true) { _defer = defer; }
+    bool deferring_reclamation() const { return _defer; }
+
+    // releases every erased subtree still queued for reclamation; the queue may be flushed
+    // from another thread, provided the allocator allows it (see background_reclaimer)
+    void flush() {
+        node_type* n = _deferred.exchange(NULL);
+        while (NULL != n) {
+            // queued subtrees are chained through their parent links
+            node_type* next = n->_parent;
+            _delete_node(n);
+            n = next;
+        }
     }
 
     void swap(tree_type& src) {
         if (this == &src) return;
         std::swap(_root, src._root);
+        if (!empty()) _root->_tree = this;
+        if (!src.empty()) src._root->_tree = &src;
+        // contents swapped out of an open batch are settled, unless they land in another one
+        if (0 == _batch) _settle();
+        if (0 == src._batch) src._settle();
+        if (node_alloc_traits::propagate_on_container_swap::value) {
+            flush();
+            src.flush();
+            std::swap(_node_allocator, src._node_allocator);
+        }
     }
 
+    // Moves the subtree at src to be this tree's contents.  Each moved node's cached top and
+    // ply are re-stamped, as for any move to another tree or ply: O(size of the subtree).
     void graft(node_type& src) {
+        // nodes cannot migrate to a tree whose allocator did not create them, so copy instead
+        if (_node_allocator != src.tree()._node_allocator) {
+            insert(src);
+            src.erase();
+            return;
+        }
         node_type* s = &src;
         node_base_type::_excise(s);
         clear();
@@ -228,7 +338,6 @@ struct tree {
 
     void insert(const node_type& src) {
         node_type* n = src._copy_data(*this);
-        node_base_type::_thread(n);
         clear();
         _root = n;
         _graft(n);
@@ -239,6 +348,73 @@ struct tree {
         else insert(src.root());
     }
 
+    // moves the subtree at src here, relinking its nodes instead of copying them
+    void insert(node_type&& src) {
+        if (src._detached()) insert(static_cast<const node_type&>(src));
+        else graft(src);
+    }
+
+    void insert(tree_type&& src) {
+        if (src.empty()) erase();
+        else graft(src.root());
+    }
+
+    // Defers the upkeep of sizes and heights across a run of edits.  While a batch is open,
+    // inserts, erases and grafts only mark the nodes above them as stale; when the last open
+    // batch commits, or goes out of scope, the stale region is recomputed once, bottom up.
+    // Sizes and depths read inside a batch are not current, and the tree should not be
+    // copied or compared until it commits.  Batches may nest.
+    struct batch_scope {
+        explicit batch_scope(tree_type& t) : _tree(&t) { t._batch += 1; }
+        batch_scope(batch_scope&& src) : _tree(src._tree) { src._tree = NULL; }
+        ~batch_scope() { commit(); }
+
+        void commit() {
+            if (NULL == _tree) return;
+            tree_type* t = _tree;
+            _tree = NULL;
+            t->_batch -= 1;
+            if (t->_batch == 0) t->_settle();
+        }
+
+        private:
+        tree_type* _tree;
+        batch_scope(const batch_scope&);
+        batch_scope& operator=(const batch_scope&);
+    };
+
+    batch_scope begin_batch() { return batch_scope(*this); }
+
+    // Replaces the contents with a tree built in O(n) from columns of n nodes: node i holds
+    // the i-th value from data, and its parent is the node at index parents[i].  The root is
+    // the one node whose parent index lies outside [0, n), such as -1.  Raw children keep
+    // the order of their indices.  Keyed trees take (key, data) pairs; the root's key is unused.
+    template <typename ParentIter, typename DataIter>
+    void build_from_parents(ParentIter first, ParentIter last, DataIter data) {
+        index_vector parent(_node_allocator);
+        for (;  first != last;  ++first)  parent.push_back(static_cast<size_type>(*first));
+        _build(parent, data);
+    }
+
+    // as build_from_parents(), for n nodes linked by (parent, child) index pairs
+    template <typename EdgeIter, typename DataIter>
+    void build_from_edges(EdgeIter first, EdgeIter last, DataIter data, size_type n) {
+        // nodes no edge reaches keep an out of range parent, marking them as roots
+        index_vector parent(n, n, _node_allocator);
+        for (;  first != last;  ++first) {
+            size_type p = static_cast<size_type>(first->first);
+            size_type c = static_cast<size_type>(first->second);
+            if ((p >= n) || (c >= n)) throw missing_exception("build_from_edges(): node index out of range");
+            if (parent[c] != n) throw parent_exception("build_from_edges(): node has more than one parent");
+            parent[c] = p;
+        }
+        _build(parent, data);
+    }
+
+    // makes this tree a deep copy of src, copying large subtrees on several threads at once;
+    // defined in st_tree_parallel.h, which must be included to use it
+    void copy_from(const tree_type& src, const parallel_policy& policy);
+
     bool operator==(const tree& rhs) const {
         if (size() != rhs.size()) return false;
         if (size() == 0) return true;
@@ -264,6 +440,8 @@ struct tree {
     bf_iterator bf_end() { return bf_iterator(); }
     const_bf_iterator bf_begin() const { return const_bf_iterator(_root); }
     const_bf_iterator bf_end() const { return const_bf_iterator(); }
+    bf_iterator bf_begin(traversal_context& c) { return bf_iterator(_root, c); }
+    const_bf_iterator bf_begin(traversal_context& c) const { return const_bf_iterator(_root, c); }
 
     df_post_iterator df_post_begin() { return df_post_iterator(_root); }
     df_post_iterator df_post_end() { return df_post_iterator(); }
@@ -279,21 +457,154 @@ struct tree {
     template <typename _Tree, typename _Data> friend struct detail::node_raw;
     template <typename _Tree, typename _Data, typename _Compare> friend struct detail::node_ordered;
     template <typename _Tree, typename _Data, typename _Key, typename _Compare> friend struct detail::node_keyed;
+    template <typename _Tree> friend struct tree_builder;
 
     protected:
+    typedef std::allocator_traits<node_allocator_type> node_alloc_traits;
+    typedef detail::pool_dispatch<node_allocator_type> pool_dispatch;
+    typedef std::vector<size_type, typename node_alloc_traits::template rebind_alloc<size_type> > index_vector;
+    typedef std::vector<node_type*, typename node_alloc_traits::template rebind_alloc<node_type*> > node_vector;
+
     node_type* _root;
     node_allocator_type _node_allocator;
-    static const node_type _node_init_val;
-
-    node_type* _new_node() {
-        node_type* n = _node_allocator.allocate(1);
-        std::allocator_traits<node_allocator_type>::construct(_node_allocator, n, _node_init_val);
+    std::atomic<node_type*> _deferred;
+    bool _defer;
+    size_type _batch;
+
+    template <typename... Args>
+    node_type* _new_node(Args&&... args) {
+        node_type* n = node_alloc_traits::allocate(_node_allocator, 1);
+        // child containers are constructed with a rebound copy of the tree allocator,
+        // and node data is constructed directly from args
+        try {
+            node_alloc_traits::construct(_node_allocator, n, cs_allocator_type(_node_allocator), std::forward<Args>(args)...);
+        } catch (...) {
+            node_alloc_traits::deallocate(_node_allocator, n, 1);
+            throw;
+        }
+        pool_dispatch::count(_node_allocator, 1);
         return n;
     }
 
     void _delete_node(node_type* n) {
-        std::allocator_traits<node_allocator_type>::destroy(_node_allocator, n);
-        std::allocator_traits<node_allocator_type>::deallocate(_node_allocator, n, 1);
+        // Releases the subtree bottom up without recursion or allocation: descend by unlinking
+        // a child at each step, and climb back through parent links once a node is a leaf.
+        // Nodes reach their destructor childless, so it has nothing left to do.
+        node_type* q = n;
+        while (true) {
+            if (!q->empty()) {
+                q = q->_take_child();
+                continue;
+            }
+            node_type* p = q->_parent;
+            bool done = (q == n);
+            node_alloc_traits::destroy(_node_allocator, q);
+            node_alloc_traits::deallocate(_node_allocator, q, 1);
+            pool_dispatch::count(_node_allocator, -1);
+            if (done) break;
+            q = p;
+        }
+    }
+
+    // Bulk build: counting children gives each node a contiguous run of child indices, a
+    // breadth-first pass over those runs orders the nodes from the root down, and sizes and
+    // heights are then summed up from the leaves, one parent at a time.
+    template <typename DataIter>
+    void _build(const index_vector& parent, DataIter data) {
+        const size_type n = parent.size();
+        if (n == 0) {
+            clear();
+            return;
+        }
+
+        size_type root = n;
+        index_vector start(n + 1, 0, _node_allocator);
+        for (size_type i = 0;  i < n;  ++i) {
+            if (parent[i] < n) {
+                start[parent[i] + 1] += 1;
+                continue;
+            }
+            if (root != n) throw parent_exception("build: more than one root");
+            root = i;
+        }
+        if (root == n) throw cycle_exception("build: no root");
+        for (size_type i = 0;  i < n;  ++i)  start[i + 1] += start[i];
+        index_vector child(n, 0, _node_allocator);
+        {
+            index_vector next(start.begin(), start.end() - 1, _node_allocator);
+            for (size_type i = 0;  i < n;  ++i) {
+                if (i != root) child[next[parent[i]]++] = i;
+            }
+        }
+        // nodes the root does not reach hang from a cycle
+        index_vector order(_node_allocator);
+        order.reserve(n);
+        order.push_back(root);
+        for (size_type k = 0;  k < order.size();  ++k) {
+            size_type q = order[k];
+            for (size_type j = start[q];  j < start[q + 1];  ++j)  order.push_back(child[j]);
+        }
+        if (order.size() != n) throw cycle_exception("build: parent links form a cycle");
+
+        node_vector nodes(n, static_cast<node_type*>(NULL), _node_allocator);
+        size_type made = 0;
+        try {
+            for (;  made < n;  ++made, ++data)  nodes[made] = _make_node(*data);
+        } catch (...) {
+            for (size_type i = 0;  i < made;  ++i)  _delete_node(nodes[i]);
+            throw;
+        }
+
+        // children are linked in breadth-first order, so everything linked so far hangs from the root
+        node_type* r = nodes[root];
+        size_type k = 1;
+        try {
+            for (;  k < n;  ++k)  _append(nodes[parent[order[k]]], nodes[order[k]]);
+        } catch (...) {
+            _delete_node(r);
+            for (;  k < n;  ++k)  _delete_node(nodes[order[k]]);
+            throw;
+        }
+        for (k = n - 1;  k > 0;  --k)  _collect(nodes[order[k]]);
+
+        clear();
+        _root = r;
+        _graft(r);
+    }
+
+    // keyed models take a (key, data) pair here, the others just data
+    template <typename Value>
+    node_type* _make_node(Value&& v) { return node_type::_make(*this, std::forward<Value>(v)); }
+
+    // Links the new leaf c as the last child of p, and sets its cached top and ply.  Sizes and
+    // heights are left alone: builders collect each finished subtree into its parent instead.
+    void _append(node_type* p, node_type* c) {
+        p->_adopt(c);
+        if (!node_type::_linked(c)) throw exception("_append(): sibling keys are not unique");
+        c->_parent = p;
+        c->_top = p->_top;
+        c->_ply = 1 + p->_ply;
+    }
+
+    // adds the finished subtree at c to its parent's size and height
+    static void _collect(node_type* c) {
+        node_type::size_dispatch_type::collect(c->_parent, c);
+        node_type::height_dispatch_type::collect(c->_parent, c);
+    }
+
+    // recomputes the nodes a batch left stale
+    void _settle() {
+        if (!empty()) node_type::_settle(_root);
+    }
+
+    // releases an unlinked subtree, or queues it while reclamation is deferred
+    void _reclaim(node_type* n) {
+        if (!_defer) {
+            _delete_node(n);
+            return;
+        }
+        n->_parent = _deferred.load();
+        while (!_deferred.compare_exchange_weak(n->_parent, n)) {}
     }
 
     void _prune(node_type* n) {
@@ -302,12 +613,132 @@ struct tree {
     void _graft(node_type* n) {
         n->_parent = NULL;
         n->_tree = this;
+        node_type::_stamp(n, n, 0);
+        if (0 == _batch) node_type::_settle(n);
     }
 };
 
 
-template <typename Data, typename CSModel, typename Alloc>
-const typename tree<Data, CSModel, Alloc>::node_type tree<Data, CSModel, Alloc>::_node_init_val;
+// Visits the subtree at n depth first, calling v.enter(node, ply) on the way down and
+// v.exit(node, ply) on the way back up, with ply counted from n.  If enter() returns
+// false the node's children are skipped, though its exit() is still called.
+template <typename Node, typename Visitor>
+void visit(Node& n, Visitor&& v) {
+    detail::d1st_walk<typename std::remove_const<Node>::type>::run(n, v);
+}
+
+template <typename Data, typename CSModel, typename Alloc, typename Tracking, typename Visitor>
+void visit(tree<Data, CSModel, Alloc, Tracking>& t, Visitor&& v) {
+    if (!t.empty()) visit(t.root(), v);
+}
+
+template <typename Data, typename CSModel, typename Alloc, typename Tracking, typename Visitor>
+void visit(const tree<Data, CSModel, Alloc, Tracking>& t, Visitor&& v) {
+    if (!t.empty()) visit(t.root(), v);
+}
+
+
+// Builds a tree from a pre-order stream of events: begin_node() opens a node as the next
+// child of the innermost open node, and end_node() closes it.  Each node is linked to its
+// parent as it opens, and its finished size and height are added to the parent's as it
+// closes, so every event costs O(1) amortized however deep the tree.  The new tree takes
+// the place of the target's contents when its root closes; until then the target is left
+// alone, and a builder destroyed mid-stream releases what it has built.
+template <typename Tree>
+struct tree_builder {
+    typedef Tree tree_type;
+    typedef typename Tree::node_type node_type;
+    typedef typename Tree::data_type data_type;
+    typedef typename Tree::size_type size_type;
+
+    explicit tree_builder(tree_type& t) : _tree(t), _root(NULL), _open() {}
+    ~tree_builder() { _reset(); }
+
+    // for keyed trees these give the node a default key, which will do for the root
+    void begin_node(const data_type& data) { _begin(_tree._new_node(data)); }
+    void begin_node(data_type&& data) { _begin(_tree._new_node(std::move(data))); }
+
+    template <typename Key>
+    void begin_node(const Key& key, const data_type& data) { _begin(_tree._make_node(typename node_type::kv_pair(key, data))); }
+
+    void end_node() {
+        if (_open.empty()) throw missing_exception("end_node(): no open node");
+        node_type* c = _open.back();
+        _open.pop_back();
+        if (!_open.empty()) {
+            tree_type::_collect(c);
+            return;
+        }
+        // the root has closed: the tree is complete
+        _root = NULL;
+        _tree.clear();
+        _tree._root = c;
+        _tree._graft(c);
+    }
+
+    // number of nodes opened and not yet closed
+    size_type open() const { return _open.size(); }
+
+    protected:
+    // not from the tree's allocator: a node pool may drop all of its memory when the tree is
+    // cleared, and the stack outlives any one tree the builder completes
+    typedef std::vector<node_type*> node_stack;
+
+    tree_type& _tree;
+    node_type* _root;
+    node_stack _open;
+
+    void _begin(node_type* n) {
+        try {
+            _open.push_back(n);
+        } catch (...) {
+            _tree._delete_node(n);
+            throw;
+        }
+        if (_open.size() == 1) {
+            _root = n;
+            return;
+        }
+        try {
+            _tree._append(_open.end()[-2], n);
+        } catch (...) {
+            _open.pop_back();
+            _tree._delete_node(n);
+            throw;
+        }
+    }
+
+    void _reset() {
+        if (NULL != _root) _tree._delete_node(_root);
+        _root = NULL;
+        _open.clear();
+    }
+
+    private:
+    tree_builder(const tree_builder&);
+    tree_builder& operator=(const tree_builder&);
+};
+
+
+// Erases every node below n that pred matches, each along with its subtree, and returns how
+// many nodes pred matched; nodes under a match are not tested.  It is one depth-first pass:
+// each child container is sifted in place, sizes and heights below n are summed once at the
+// end, and n's ancestors see a single update, or all of it waits for an open batch to commit.
+template <typename Node, typename Pred>
+typename Node::size_type erase_if(Node& n, Pred pred) {
+    return detail::erase_walk<Node>::run(n, pred);
+}
+
+// the root is tested too, and if pred matches it the tree is cleared
+template <typename Data, typename CSModel, typename Alloc, typename Tracking, typename Pred>
+typename tree<Data, CSModel, Alloc, Tracking>::size_type erase_if(tree<Data, CSModel, Alloc, Tracking>& t, Pred pred) {
+    if (t.empty()) return 0;
+    if (pred(static_cast<const typename tree<Data, CSModel, Alloc, Tracking>::node_type&>(t.root()))) {
+        t.clear();
+        return 1;
+    }
+    return erase_if(t.root(), pred);
+}
 
 
 }  // namespace st_tree
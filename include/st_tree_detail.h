@@ -22,22 +22,32 @@ limitations under the License.
 #define __st_tree_detail_h__ 1
 
 #include <vector>
-#include <deque>
 #include <set>
 #include <map>
 #include <functional>
 #include <algorithm>
 #include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// Nodes, iterators and comparators are never deleted through a base pointer, so by
+// default their destructors are non-virtual, which keeps a vptr out of every node and
+// every iterator frame.  Define ST_TREE_VIRTUAL_DESTRUCTORS to restore the older layout.
+#if defined(ST_TREE_VIRTUAL_DESTRUCTORS)
+#define ST_TREE_VIRTUAL virtual
+#else
+#define ST_TREE_VIRTUAL
+#endif
 
 namespace st_tree {
 
 // forward declarations
-template <typename Data, typename CSModel=raw<>, typename Alloc=std::allocator<Data> > struct tree;
+template <typename Data, typename CSModel=raw<>, typename Alloc=std::allocator<Data>, typename Tracking=tracking<> > struct tree;
 
 namespace detail {
 
 using std::vector;
-using std::deque;
 using std::multiset;
 using std::map;
 using std::less;
@@ -51,69 +61,6 @@ template <typename Tree, typename Data> struct node_raw;
 template <typename Tree, typename Data, typename Compare> struct node_ordered;
 template <typename Tree, typename Data, typename Key, typename Compare> struct node_keyed;
 
-template <typename Unsigned, typename Alloc>
-struct max_maintainer {
-    typedef size_t size_type;
-
-    max_maintainer(): _hist(), _max(0) {}
-    virtual ~max_maintainer() {}
-
-    max_maintainer(const max_maintainer& src) { *this = src; }
-    max_maintainer& operator=(const max_maintainer& rhs) {
-        if (this == &rhs) return *this;
-        _max = rhs._max;
-        _hist = rhs._hist;
-        return *this;
-    }
-
-    Unsigned max() const { return _max; }
-
-    void insert(const Unsigned& n) {
-        if (n >= _hist.size()) _hist.resize(1+n, 0);
-        _hist[n] += 1;
-        if (n > _max) _max = n;
-    }
-
-    void erase(const Unsigned& n) {
-        if (n > _max) return;
-        _hist[n] -= 1;
-        while ((_max > 0) && (_hist[_max] <= 0)) _max -= 1;
-    }
-
-    void insert(const max_maintainer& src, const Unsigned& d) {
-        if (src._hist.size() <= 0) return;
-        if ((src._max + d) > _max) _max = src._max + d;
-        if (_max >= _hist.size()) _hist.resize(1+_max, 0);
-        for (size_type s = 0;  s <= src._max;  ++s) _hist[s + d] += src._hist[s];
-    }
-
-    void erase(const max_maintainer& src, const Unsigned& d) {
-        if (src._hist.size() <= 0) return;
-        size_type n = src._max;
-        if (d > _max) return;
-        if ((_max-d) < n) n = _max-d;
-        for (size_type s = 0;  s <= n;  ++s) _hist[s + d] -= src._hist[s];
-        while ((_max > 0) && (_hist[_max] <= 0)) _max -= 1;
-    }
-
-    void clear() {
-        _hist.clear();
-        _max = 0;
-    }
-
-    void swap(max_maintainer& src) {
-        if (this == &src) return;
-        std::swap(_max, src._max);
-        _hist.swap(src._hist);
-    }
-
-    protected:
-    typedef typename std::allocator<Unsigned> unsigned_allocator;
-    vector<Unsigned, unsigned_allocator> _hist;
-    Unsigned _max;
-};
-
-
 // This is my poor-man substitute for typeof(*dr)
 template <typename DR> struct dr_value {};
 
@@ -171,16 +118,11 @@ struct valmap_iterator_adaptor_forward {
 
     // default ctor/dtor
     valmap_iterator_adaptor_forward(): _base(), _vmap() {}
-    virtual ~valmap_iterator_adaptor_forward() {}
+    ST_TREE_VIRTUAL ~valmap_iterator_adaptor_forward() = default;
 
     // copy/assign
-    valmap_iterator_adaptor_forward(const valmap_iterator_adaptor_forward& src): _base(src._base), _vmap(src._vmap) {}
-    valmap_iterator_adaptor_forward& operator=(const valmap_iterator_adaptor_forward& rhs) {
-        if (this == &rhs) return *this;
-        _base = rhs._base;
-        _vmap = rhs._vmap;
-        return *this;
-    }
+    valmap_iterator_adaptor_forward(const valmap_iterator_adaptor_forward&) = default;
+    valmap_iterator_adaptor_forward& operator=(const valmap_iterator_adaptor_forward&) = default;
 
     // casting
     base_iterator_type base() const { return this->_base; }
@@ -234,15 +176,10 @@ struct valmap_iterator_adaptor_random {
 
     public:
     valmap_iterator_adaptor_random() : _base(), _vmap() {}
-    virtual ~valmap_iterator_adaptor_random() {}
+    ST_TREE_VIRTUAL ~valmap_iterator_adaptor_random() = default;
     
-    valmap_iterator_adaptor_random(const valmap_iterator_adaptor_random& src): _base(src._base), _vmap(src._vmap) {}
-    valmap_iterator_adaptor_random& operator=(const valmap_iterator_adaptor_random& src) {
-        if (this == &src) return *this;
-        _base = src._base;
-        _vmap = src._vmap;
-        return *this;
-    }
+    valmap_iterator_adaptor_random(const valmap_iterator_adaptor_random&) = default;
+    valmap_iterator_adaptor_random& operator=(const valmap_iterator_adaptor_random&) = default;
 
     base_iterator_type base() const { return this->_base; }
     valmap_iterator_adaptor_random(const base_iterator_type& src) : _base(src), _vmap() {}
@@ -354,7 +291,7 @@ struct valmap_iterator_dispatch<Iterator, ValMap, std::random_access_iterator_ta
 template <typename Compare>
 struct ptr_less {
     ptr_less() : _comp() {}
-    virtual ~ptr_less() {}
+    ST_TREE_VIRTUAL ~ptr_less() = default;
 
     template <typename Pointer>
     bool operator()(const Pointer& a, const Pointer& b) const { return _comp(*a, *b); }
@@ -365,7 +302,7 @@ struct ptr_less {
 template <typename Compare>
 struct ptr_less_data {
     ptr_less_data() : _comp() {}
-    virtual ~ptr_less_data() {}
+    ST_TREE_VIRTUAL ~ptr_less_data() = default;
 
     template <typename Pointer>
     bool operator()(const Pointer& a, const Pointer& b) const { return _comp(a->data(), b->data()); }
@@ -374,19 +311,21 @@ struct ptr_less_data {
 };
 
 
+// Three-way comparison of two child container entries, ahead of comparing their subtrees.
+// Only keyed children carry anything of their own (the key) to compare.
 template <typename Container>
-struct dereferenceable_lessthan {
-    template <typename D>
-    bool operator()(const D& a, const D& b) const { return *a < *b; }
+struct child_key_compare {
+    template <typename J>
+    int operator()(const J&, const J&) const { return 0; }
 };
 
 template <typename Key, typename Data, typename Compare, typename Alloc>
-struct dereferenceable_lessthan<map<Key, Data, Compare, Alloc> > {
-    template <typename D>
-    bool operator()(const D& a, const D& b) const {
-        if (_lt((a.first), (b.first))) return true;
-        if (_lt((b.first), (a.first))) return false;
-        return *(a.second) < *(b.second);
+struct child_key_compare<map<Key, Data, Compare, Alloc> > {
+    template <typename J>
+    int operator()(const J& a, const J& b) const {
+        if (_lt(a->first, b->first)) return -1;
+        if (_lt(b->first, a->first)) return 1;
+        return 0;
     }
     Compare _lt;
 };
@@ -445,8 +384,8 @@ struct node_type_dispatch<Tree, keyed<Key, Compare> > {
 
 namespace std {
 
-template <typename Data, typename CSModel, typename Alloc>
-void swap(st_tree::tree<Data, CSModel, Alloc>& a, st_tree::tree<Data, CSModel, Alloc>& b) {
+template <typename Data, typename CSModel, typename Alloc, typename Tracking>
+void swap(st_tree::tree<Data, CSModel, Alloc, Tracking>& a, st_tree::tree<Data, CSModel, Alloc, Tracking>& b) {
     a.swap(b);
 }
 
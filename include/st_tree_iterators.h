@@ -28,6 +28,37 @@ limitations under the License.
 namespace st_tree {
 namespace detail {
 
+template <typename Node, typename Value, typename Alloc> struct b1st_iterator;
+
+// Scratch space for breadth-first traversals that can be reused across many of them.  A
+// traversal started on a context runs on its queue, which keeps the capacity of the longest
+// queue seen so far, so repeated traversals allocate nothing after the first.  A context
+// serves one traversal at a time.  Moving an iterator hands the context along with it,
+// while a copy detaches and takes its own queue, so copies stay independent.
+template <typename Node, typename Alloc>
+struct traversal_context {
+    typedef size_t size_type;
+
+    traversal_context() : _queue() {}
+    explicit traversal_context(size_type n) : _queue() { _queue.reserve(n); }
+    ST_TREE_VIRTUAL ~traversal_context() = default;
+
+    void reserve(size_type n) { _queue.reserve(n); }
+    size_type capacity() const { return _queue.capacity(); }
+
+    protected:
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<Node*> node_ptr_allocator_type;
+    vector<Node*, node_ptr_allocator_type> _queue;
+
+    friend struct b1st_iterator<Node, Node, Alloc>;
+    friend struct b1st_iterator<Node, const Node, Alloc>;
+};
+
+
+// The breadth-first queue is a vector consumed from _head, so the end iterator (an empty
+// queue) neither allocates nor costs more than an index comparison.  The queue is either the
+// iterator's own, or borrowed from a traversal_context; copies always get their own, moves
+// keep borrowing, and a moved-from iterator is left at the end.
 template <typename Node, typename Value, typename Alloc>
 struct b1st_iterator {
     typedef Node node_type;
@@ -39,32 +70,67 @@ struct b1st_iterator {
     typedef Value* pointer;
     typedef Value& reference;
 
-    b1st_iterator() : _queue() {}
-    virtual ~b1st_iterator() {}
+    typedef traversal_context<Node, Alloc> context_type;
 
-    b1st_iterator(const b1st_iterator& rhs) : _queue(rhs._queue) {}
-    b1st_iterator& operator=(const b1st_iterator& rhs) { _queue = rhs._queue; return *this; }
+    b1st_iterator() : _own(), _queue(&_own), _head(0), _skip(false) {}
+    ST_TREE_VIRTUAL ~b1st_iterator() = default;
 
-    b1st_iterator(value_type* root) {
+    b1st_iterator(const b1st_iterator& rhs) : _own(rhs._queue->begin() + rhs._head, rhs._queue->end()), _queue(&_own), _head(0), _skip(rhs._skip) {}
+    b1st_iterator& operator=(const b1st_iterator& rhs) {
+        if (this == &rhs) return *this;
+        _own.assign(rhs._queue->begin() + rhs._head, rhs._queue->end());
+        _queue = &_own;
+        _head = 0;
+        _skip = rhs._skip;
+        return *this;
+    }
+
+    b1st_iterator(b1st_iterator&& rhs) : _own(), _queue(&_own), _head(0), _skip(false) { _take(rhs); }
+    b1st_iterator& operator=(b1st_iterator&& rhs) {
+        if (this == &rhs) return *this;
+        _take(rhs);
+        return *this;
+    }
+
+    b1st_iterator(value_type* root) : _own(), _queue(&_own), _head(0), _skip(false) {
         if (root == NULL) return;
-        _queue.push_back(const_cast<node_type*>(root));
+        _queue->push_back(const_cast<node_type*>(root));
     }
 
-    reference operator*() const { return *(_queue.front()); }
-    pointer operator->() const { return _queue.front(); }
+    b1st_iterator(value_type* root, context_type& c) : _own(), _queue(&c._queue), _head(0), _skip(false) {
+        _queue->clear();
+        if (root == NULL) return;
+        _queue->push_back(const_cast<node_type*>(root));
+    }
+
+    reference operator*() const { return *((*_queue)[_head]); }
+    pointer operator->() const { return (*_queue)[_head]; }
+
+    // the children of the current node will not be queued, so its subtree is not visited
+    void skip_children() { _skip = true; }
 
     // pre-increment iterator
-    b1st_iterator operator++() {
+    b1st_iterator& operator++() {
         // if we are already past the end of elements in tree, then this is a no-op
-        if (_queue.empty()) return *this;
+        if (_empty()) return *this;
         
         // take current node off front of the queue
-        node_type* f(_queue.front());
-        _queue.pop_front();
+        node_type* f((*_queue)[_head]);
+        _head += 1;
+
+        // drop the consumed prefix once it outweighs what is left, which is amortized O(1) per step
+        if (_head > (_queue->size() - _head)) {
+            _queue->erase(_queue->begin(), _queue->begin() + _head);
+            _head = 0;
+        }
 
+        if (_skip) {
+            _skip = false;
+            return *this;
+        }
         if (f->empty()) return *this;
         for (iterator j(f->begin());  j != iterator(f->end());  ++j)
-            _queue.push_back(&*j);
+            _queue->push_back(&*j);
 
         return *this;
     }
@@ -76,15 +142,42 @@ struct b1st_iterator {
         return r;
     }
 
-    bool operator==(const b1st_iterator& rhs) const { return _queue == rhs._queue; }
-    bool operator!=(const b1st_iterator& rhs) const { return _queue != rhs._queue; }
+    // every node is queued once per traversal, so the front node identifies a position
+    bool operator==(const b1st_iterator& rhs) const {
+        if (_empty() || rhs._empty()) return _empty() == rhs._empty();
+        return (*_queue)[_head] == (*rhs._queue)[rhs._head];
+    }
+    bool operator!=(const b1st_iterator& rhs) const { return !(*this == rhs); }
 
     protected:
-    typedef typename std::allocator<node_type*> node_ptr_allocator_type;
-    deque<node_type*, node_ptr_allocator_type> _queue;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<node_type*> node_ptr_allocator_type;
+    vector<node_type*, node_ptr_allocator_type> _own;
+    vector<node_type*, node_ptr_allocator_type>* _queue;
+    size_t _head;
+    bool _skip;
+
+    bool _empty() const { return _head == _queue->size(); }
+
+    void _take(b1st_iterator& rhs) {
+        if (rhs._queue == &rhs._own) {
+            _own.swap(rhs._own);
+            _queue = &_own;
+        } else {
+            _queue = rhs._queue;
+        }
+        _head = rhs._head;
+        _skip = rhs._skip;
+        rhs._own.clear();
+        rhs._queue = &rhs._own;
+        rhs._head = 0;
+        rhs._skip = false;
+    }
 };
 
 
+// Depth-first iterators hold only the current node and the root of the traversal.  They move
+// between siblings through parent links and each node's O(1) position in its parent, so they
+// never allocate, and copying one is as cheap as copying two pointers.
 template <typename Node, typename Value, typename Alloc>
 struct d1st_post_iterator {
     typedef Node node_type;
@@ -96,78 +189,31 @@ struct d1st_post_iterator {
     typedef Value* pointer;
     typedef Value& reference;
 
-    struct frame {
-        frame(): first(), second(), visited() {}
-        virtual ~frame() {}
-        frame(const frame& rhs): first(rhs.first), second(rhs.second), visited(rhs.visited) {}
-        frame& operator=(const frame& rhs) { first=rhs.first; second=rhs.second; visited=rhs.visited; return *this; }
-        frame(node_type* first_, const iterator& second_, const bool& visited_) {
-            first = first_;  second = second_;  visited = visited_;
-        }
-        bool operator==(const frame& rhs) const {
-            if (first != rhs.first) return false;
-            if (second != rhs.second) return false;
-            if (visited != rhs.visited) return false;
-            return true;
-        }
-        bool operator!=(const frame& rhs) const { return !(*this == rhs); }
-        node_type* first;
-        iterator second;
-        bool visited;
-    };
-
-    d1st_post_iterator() : _stack() {}
-    virtual ~d1st_post_iterator() {}
+    d1st_post_iterator() : _node(NULL), _root(NULL) {}
+    ST_TREE_VIRTUAL ~d1st_post_iterator() = default;
 
-    d1st_post_iterator(const d1st_post_iterator& rhs) : _stack(rhs._stack) { }
-    d1st_post_iterator& operator=(const d1st_post_iterator& rhs) { _stack = rhs._stack; return *this; }
-
-    d1st_post_iterator(value_type* root) {
+    d1st_post_iterator(value_type* root) : _node(NULL), _root(const_cast<node_type*>(root)) {
         if (root == NULL) return;
-        _stack.push_back(frame(const_cast<node_type*>(root), iterator(const_cast<node_type*>(root)->begin()), false));
-        while (true) {
-            if (_stack.back().first->empty()) {
-                _stack.back().visited = true;
-                break;
-            }
-            iterator b(_stack.back().first->begin());
-            _stack.push_back(frame(&*b, iterator((b)->begin()), false));
-        }
+        _node = _descend(_root);
     }
 
-    reference operator*() const { return *(_stack.back().first); }
-    pointer operator->() const { return _stack.back().first; }
+    reference operator*() const { return *_node; }
+    pointer operator->() const { return _node; }
 
     // pre-increment
-    d1st_post_iterator operator++() {
+    d1st_post_iterator& operator++() {
         // if we are already past the end of elements in tree, then this is a no-op
-        if (_stack.empty()) return *this;
+        if (_node == NULL) return *this;
 
-        // check whether we are ready to pop the current frame
-        if (_stack.back().visited) _stack.pop_back();
-
-        // empty stack flags that we just incremented past last element in tree, so leave in that state
-        if (_stack.empty()) return *this;
-
-        // we just popped up stack, so move to next child at this ply:
-        ++(_stack.back().second);
-
-        // if we have visited all the children, set the visited flag for this node
-        if (_stack.back().second == iterator(_stack.back().first->end())) {
-            _stack.back().visited = true;
+        // the root of the traversal is visited last
+        if (_node == _root) {
+            _node = NULL;
             return *this;
         }
 
-        // we found a next child at current ply: push down its first children to the bottom
-        _stack.push_back(frame(&*(_stack.back().second), iterator((_stack.back().second)->begin()), false));
-        while (true) {
-            if (_stack.back().first->empty()) {
-                _stack.back().visited = true;
-                break;
-            }
-            iterator b(_stack.back().first->begin());
-            _stack.push_back(frame(&*b, iterator((b)->begin()), false));                
-        }
+        // a node's next sibling is preceded by its leftmost leaf, otherwise the parent comes next
+        node_type* s = node_type::_next_sibling(_node);
+        _node = (s != NULL) ? _descend(s) : _node->_parent;
 
         return *this;
     }
@@ -179,12 +225,17 @@ struct d1st_post_iterator {
         return r;
     }
 
-    bool operator==(const d1st_post_iterator& rhs) const { return _stack == rhs._stack; }
-    bool operator!=(const d1st_post_iterator& rhs) const { return _stack != rhs._stack; }
+    bool operator==(const d1st_post_iterator& rhs) const { return _node == rhs._node; }
+    bool operator!=(const d1st_post_iterator& rhs) const { return _node != rhs._node; }
 
     protected:
-    typedef typename std::allocator<frame> frame_allocator_type;
-    vector<frame, frame_allocator_type> _stack;
+    node_type* _node;
+    node_type* _root;
+
+    static node_type* _descend(node_type* q) {
+        while (!q->empty()) q = &*(q->begin());
+        return q;
+    }
 };
 
 
@@ -199,68 +250,40 @@ struct d1st_pre_iterator {
     typedef Value* pointer;
     typedef Value& reference;
 
-    struct frame {
-        frame(): first(), second(), visited() {}
-        virtual ~frame() {}
-        frame(const frame& rhs): first(rhs.first), second(rhs.second), visited(rhs.visited) {}
-        frame& operator=(const frame& rhs) { first=rhs.first; second=rhs.second; visited=rhs.visited; return *this; }
-        frame(node_type* first_, const iterator& second_, const bool& visited_) {
-            first = first_;  second = second_;  visited = visited_;
-        }
-        bool operator==(const frame& rhs) const {
-            if (first != rhs.first) return false;
-            if (second != rhs.second) return false;
-            if (visited != rhs.visited) return false;
-            return true;
-        }
-        bool operator!=(const frame& rhs) const { return !(*this == rhs); }
-        node_type* first;
-        iterator second;
-        bool visited;
-    };
-
-    d1st_pre_iterator() : _stack() {}
-    virtual ~d1st_pre_iterator() {}
+    d1st_pre_iterator() : _node(NULL), _root(NULL), _skip(false) {}
+    ST_TREE_VIRTUAL ~d1st_pre_iterator() = default;
 
-    d1st_pre_iterator(const d1st_pre_iterator& rhs) : _stack(rhs._stack) { }
-    d1st_pre_iterator& operator=(const d1st_pre_iterator& rhs) { _stack = rhs._stack; return *this; }
+    d1st_pre_iterator(value_type* root) : _node(const_cast<node_type*>(root)), _root(const_cast<node_type*>(root)), _skip(false) {}
 
-    d1st_pre_iterator(value_type* root) {
-        if (root == NULL) return;
-        _stack.push_back(frame(const_cast<node_type*>(root), iterator(const_cast<node_type*>(root)->begin()), false));
-    }
+    reference operator*() const { return *_node; }
+    pointer operator->() const { return _node; }
 
-    reference operator*() const { return *(_stack.back().first); }
-    pointer operator->() const { return _stack.back().first; }
+    // the next increment moves past the current node's subtree instead of into it
+    void skip_children() { _skip = true; }
 
     // pre-increment
-    d1st_pre_iterator operator++() {
+    d1st_pre_iterator& operator++() {
         // if we are already past the end of elements in tree, then this is a no-op
-        if (_stack.empty()) return *this;
+        if (_node == NULL) return *this;
 
-        // check the case where this is node we have just visited pre-order
-        if (!_stack.back().visited) {
-            _stack.back().visited = true;
-            if (!_stack.back().first->empty()) {
-                _stack.push_back(frame(&*(_stack.back().second), iterator(((_stack.back().second))->begin()), false));
-                return *this;
-            }
+        // children come first, unless they were skipped
+        bool skip = _skip;
+        _skip = false;
+        if (!skip && !_node->empty()) {
+            _node = &*(_node->begin());
+            return *this;
         }
 
-        // pop off any frames we're finished with
-        while (true) {
-            if (!_stack.back().first->empty()) {
-                ++(_stack.back().second);
-                // in this case, we're not finished at this frame:
-                if (_stack.back().second != iterator(_stack.back().first->end())) break;
+        // otherwise climb until some ancestor, short of the root, has a next sibling
+        while (_node != _root) {
+            node_type* s = node_type::_next_sibling(_node);
+            if (s != NULL) {
+                _node = s;
+                return *this;
             }
-            _stack.pop_back();
-            // if we emptied the stack, we're at end of tree elements
-            if (_stack.empty()) return *this;
+            _node = _node->_parent;
         }
-
-        // push the next child
-        _stack.push_back(frame(&*(_stack.back().second), iterator(((_stack.back().second))->begin()), false));
+        _node = NULL;
 
         return *this;
     }
@@ -272,12 +295,65 @@ struct d1st_pre_iterator {
         return r;
     }
 
-    bool operator==(const d1st_pre_iterator& rhs) const { return _stack == rhs._stack; }
-    bool operator!=(const d1st_pre_iterator& rhs) const { return _stack != rhs._stack; }
+    bool operator==(const d1st_pre_iterator& rhs) const { return _node == rhs._node; }
+    bool operator!=(const d1st_pre_iterator& rhs) const { return _node != rhs._node; }
 
     protected:
-    typedef typename std::allocator<frame> frame_allocator_type;
-    vector<frame, frame_allocator_type> _stack;
+    node_type* _node;
+    node_type* _root;
+    bool _skip;
+};
+
+
+// a visitor's enter() may return bool, where false skips the node's children, or nothing at all
+template <typename Result>
+struct enter_dispatch {
+    template <typename Visitor, typename Value>
+    static bool enter(Visitor& v, Value& n, size_t ply) {
+        v.enter(n, ply);
+        return true;
+    }
+};
+
+template <>
+struct enter_dispatch<bool> {
+    template <typename Visitor, typename Value>
+    static bool enter(Visitor& v, Value& n, size_t ply) { return v.enter(n, ply); }
+};
+
+
+// Depth-first walk calling v.enter(node, ply) before a node's children and v.exit(node, ply)
+// after them, where ply is counted from the node the walk starts at.  Like the depth-first
+// iterators it moves through parent links and positions in the parent, so it runs as a single
+// loop, without recursion and without allocating.
+template <typename Node>
+struct d1st_walk {
+    template <typename Value, typename Visitor>
+    static void run(Value& start, Visitor& v) {
+        typedef enter_dispatch<decltype(v.enter(start, size_t(0)))> enter_type;
+        Node* r = const_cast<Node*>(&start);
+        Node* q = r;
+        size_t ply = 0;
+        while (true) {
+            if (enter_type::enter(v, static_cast<Value&>(*q), ply) && !q->empty()) {
+                q = &*(q->begin());
+                ply += 1;
+                continue;
+            }
+            // exit nodes until one has a next sibling to enter
+            while (true) {
+                v.exit(static_cast<Value&>(*q), ply);
+                if (q == r) return;
+                Node* s = Node::_next_sibling(q);
+                if (s != NULL) {
+                    q = s;
+                    break;
+                }
+                q = q->_parent;
+                ply -= 1;
+            }
+        }
+    }
 };
 
 
@@ -34,8 +34,176 @@ limitations under the License.
 namespace st_tree {
 namespace detail {
 
+// Per-node bookkeeping storage.  An untracked field is an empty base, and takes no space.
+template <bool Enabled>
+struct size_field {
+    size_field() : _size(1) {}
+    size_t _size;
+};
+template <>
+struct size_field<false> {};
+
+template <bool Enabled>
+struct height_field {
+    explicit height_field(size_t h) : _height(h) {}
+    // number of plies in the subtree rooted at this node
+    size_t _height;
+};
+template <>
+struct height_field<false> {
+    explicit height_field(size_t) {}
+};
+
+
+// maintains subtree sizes as nodes are grafted and pruned
+template <typename Node, bool Enabled>
+struct size_dispatch {
+    static size_t subtree_size(const Node& n) { return n._size; }
+    static void copy(Node& n, const Node& src) { n._size = src._size; }
+
+    static void graft(Node* q, const Node* n) {
+        while (true) {
+            q->_size += n->_size;
+            if (q->is_root()) break;
+            q = q->_parent;
+        }
+    }
+
+    static void prune(Node* q, const Node* n) { prune(q, n->_size); }
+
+    static void grow(Node* q, size_t s) {
+        while (true) {
+            q->_size += s;
+            if (q->is_root()) break;
+            q = q->_parent;
+        }
+    }
+
+    static void prune(Node* q, size_t s) {
+        while (true) {
+            q->_size -= s;
+            if (q->is_root()) break;
+            q = q->_parent;
+        }
+    }
+
+    // the amount a subtree adds to the size of its ancestors
+    static size_t contribution(const Node& n) { return n._size; }
+
+    // adds a finished child subtree to q alone, for trees assembled bottom up
+    static void collect(Node* q, const Node* n) { q->_size += n->_size; }
+    static void leaf(Node& n) { n._size = 1; }
+
+    // no subtree has size zero, so zero marks a size left stale by a batch of edits
+    static bool stale(const Node& n) { return n._size == 0; }
+    static void mark(Node& n) { n._size = 0; }
+};
+
+// untracked sizes are counted on demand
+template <typename Node>
+struct size_dispatch<Node, false> {
+    static size_t subtree_size(const Node& n) {
+        size_t s = 0;
+        for (typename Node::const_df_pre_iterator j(n.df_pre_begin());  j != n.df_pre_end();  ++j) s += 1;
+        return s;
+    }
+    static void copy(Node&, const Node&) {}
+    static void graft(Node*, const Node*) {}
+    static void prune(Node*, const Node*) {}
+    static void prune(Node*, size_t) {}
+    static void grow(Node*, size_t) {}
+    static size_t contribution(const Node&) { return 0; }
+    static void collect(Node*, const Node*) {}
+    static void leaf(Node&) {}
+    static bool stale(const Node&) { return false; }
+    static void mark(Node&) {}
+};
+
+
+// maintains subtree heights as nodes are grafted and pruned
+template <typename Node, bool Enabled>
+struct height_dispatch {
+    static size_t depth(const Node& n) { return n._height; }
+    static void copy(Node& n, const Node& src) { n._height = src._height; }
+
+    static void graft(Node* q, const Node* n) {
+        // percolate the new height until it reaches an ancestor that is already at least as tall
+        size_t h = 1 + n->_height;
+        while (q->_height < h) {
+            q->_height = h;
+            if (q->is_root()) break;
+            q = q->_parent;
+            h += 1;
+        }
+    }
+
+    static void prune(Node* q, const Node* n) { prune(q, n->_height, n); }
+
+    // removes a branch of height h from q, where skip is that branch if q still holds it
+    static void prune(Node* q, size_t h, const Node* skip) {
+        // heights only need to be recomputed while the pruned branch was the tallest one
+        while (q->_height <= 1 + h) {
+            h = q->_height;
+            q->_height = child_height(q, skip);
+            if ((q->_height == h) || q->is_root()) break;
+            skip = NULL;
+            q = q->_parent;
+        }
+    }
+
+    // height of q computed from its children, not counting 'skip' if it is still among them
+    static size_t child_height(const Node* q, const Node* skip) {
+        size_t h = 0;
+        for (typename Node::const_iterator j(q->begin());  j != q->end();  ++j) {
+            if ((&*j == skip) || (j->_height <= h)) continue;
+            h = j->_height;
+            // no child can be taller than q's current height allows, so the scan can stop here
+            if (1 + h >= q->_height) break;
+        }
+        return 1 + h;
+    }
+
+    // the height a subtree presents to its parent
+    static size_t contribution(const Node& n) { return n._height; }
+
+    static void collect(Node* q, const Node* n) {
+        if (q->_height <= n->_height) q->_height = 1 + n->_height;
+    }
+    static void leaf(Node& n) { n._height = 1; }
+
+    // likewise for heights, which also start at one
+    static bool stale(const Node& n) { return n._height == 0; }
+    static void mark(Node& n) { n._height = 0; }
+};
+
+// untracked heights are measured on demand
+template <typename Node>
+struct height_dispatch<Node, false> {
+    static size_t depth(const Node& n) {
+        // the deepest ply reached under n, measured from n itself
+        size_t h = 0;
+        for (typename Node::const_df_pre_iterator j(n.df_pre_begin());  j != n.df_pre_end();  ++j) {
+            if (j->ply() > h) h = j->ply();
+        }
+        return 1 + h - n.ply();
+    }
+    static void copy(Node&, const Node&) {}
+    static void graft(Node*, const Node*) {}
+    static void prune(Node*, const Node*) {}
+    static void prune(Node*, size_t, const Node*) {}
+    static size_t contribution(const Node&) { return 0; }
+    static void collect(Node*, const Node*) {}
+    static void leaf(Node&) {}
+    static bool stale(const Node&) { return false; }
+    static void mark(Node&) {}
+};
+
+
+// see erase_if() in st_tree.h
+template <typename Node> struct erase_walk;
+
 template <typename Tree, typename Node, typename ChildContainer>
-struct node_base {
+struct node_base: protected size_field<Tree::tracking_type::size>, protected height_field<Tree::tracking_type::depth> {
     typedef Tree tree_type;
     typedef Node node_type;
     typedef ChildContainer cs_type;
@@ -46,7 +214,14 @@ struct node_base {
     protected:
     typedef typename cs_type::iterator cs_iterator;
     typedef typename cs_type::const_iterator cs_const_iterator;
-    
+    typedef typename cs_type::allocator_type cs_allocator_type;
+    typedef size_field<Tree::tracking_type::size> size_field_type;
+    typedef height_field<Tree::tracking_type::depth> height_field_type;
+    typedef size_dispatch<node_type, Tree::tracking_type::size> size_dispatch_type;
+    typedef height_dispatch<node_type, Tree::tracking_type::depth> height_dispatch_type;
+    // stale nodes are marked in whichever field is tracked; with neither, batches have nothing to defer
+    typedef typename std::conditional<Tree::tracking_type::size, size_dispatch_type, height_dispatch_type>::type stale_dispatch_type;
+
     public:
     typedef typename valmap_iterator_dispatch<cs_iterator, typename vmap_dispatch<node_type, typename cs_iterator::value_type>::vmap, typename cs_iterator::iterator_category>::adaptor_type iterator;
     typedef typename valmap_iterator_dispatch<cs_const_iterator, typename vmap_dispatch<node_type, typename cs_const_iterator::value_type>::vmap, typename cs_const_iterator::iterator_category>::adaptor_type const_iterator;
@@ -58,6 +233,7 @@ struct node_base {
 
     typedef b1st_iterator<node_type, node_type, allocator_type> bf_iterator;
     typedef b1st_iterator<node_type, const node_type, allocator_type> const_bf_iterator;
+    typedef st_tree::detail::traversal_context<node_type, allocator_type> traversal_context;
     typedef d1st_post_iterator<node_type, node_type, allocator_type> df_post_iterator;
     typedef d1st_post_iterator<node_type, const node_type, allocator_type> const_df_post_iterator;
     typedef d1st_pre_iterator<node_type, node_type, allocator_type> df_pre_iterator;
@@ -67,6 +243,9 @@ struct node_base {
     bf_iterator bf_end() { return bf_iterator(); }
     const_bf_iterator bf_begin() const { return const_bf_iterator(static_cast<const node_type*>(this)); }
     const_bf_iterator bf_end() const { return const_bf_iterator(); }
+    // breadth-first traversals on a reusable context's queue
+    bf_iterator bf_begin(traversal_context& c) { return bf_iterator(static_cast<node_type*>(this), c); }
+    const_bf_iterator bf_begin(traversal_context& c) const { return const_bf_iterator(static_cast<const node_type*>(this), c); }
 
     df_post_iterator df_post_begin() { return df_post_iterator(static_cast<node_type*>(this)); }
     df_post_iterator df_post_end() { return df_post_iterator(); }
@@ -78,44 +257,35 @@ struct node_base {
     const_df_pre_iterator df_pre_begin() const { return const_df_pre_iterator(static_cast<const node_type*>(this)); }
     const_df_pre_iterator df_pre_end() const { return const_df_pre_iterator(); }
 
-    node_base() : _tree(NULL), _size(1), _parent(NULL), _data(), _children(), _depth() {}
-    virtual ~node_base() {
+    node_base() : height_field_type(0), _tree(NULL), _parent(NULL), _top(static_cast<node_type*>(this)), _ply(0), _data(), _children() {}
+    // nodes created by a tree start out as leaves, with data constructed in place from args
+    template <typename... Args>
+    explicit node_base(const cs_allocator_type& a, Args&&... args) : height_field_type(1), _tree(NULL), _parent(NULL), _top(static_cast<node_type*>(this)), _ply(0), _data(std::forward<Args>(args)...), _children(a) {}
+    ST_TREE_VIRTUAL ~node_base() {
         // Saves work, and also prevents exception attempting to call tree() on default-constructed nodes
         if (_children.empty() || _default_constructed()) return;
-        // Save off child pointers, take down the child container, and then deallocate children
-        vector<node_type*> d;
-        for (iterator j(begin());  j != end();  ++j)  d.push_back(&*j);
-        _children.clear();
+        // Nodes owned by a tree have their children released by tree::_delete_node(), so this
+        // is only reached by free-standing nodes.  Child containers never dereference their
+        // node pointers when iterated or cleared, so children can be released in place.
         tree_type& tree_ = this->tree();
-        for (typename vector<node_type*>::iterator e(d.begin());  e != d.end();  ++e)  tree_._delete_node(*e);
+        for (iterator j(begin());  j != end();  ++j)  tree_._delete_node(&*j);
+        _children.clear();
     }
 
-    size_type ply() const {
-        size_type p = 0;
-        const node_type* q = static_cast<const node_type*>(this);
-        while (!q->is_root()) {
-            q = q->_parent;
-            p += 1;
-        }
-        return p;
-    }
+    size_type ply() const { return _ply; }
 
     tree_type& tree() {
-        node_type* q = static_cast<node_type*>(this);
-        while (!q->is_root())  q = q->_parent;
-        if (NULL == q->_tree) throw orphan_exception("tree(): orphan node has no associated tree");
-        return *(q->_tree);
+        if (NULL == _top->_tree) throw orphan_exception("tree(): orphan node has no associated tree");
+        return *(_top->_tree);
     }
 
     const tree_type& tree() const {
-        const node_type* q = static_cast<const node_type*>(this);
-        while (!q->is_root())  q = q->_parent;
-        if (NULL == q->_tree) throw orphan_exception("tree(): orphan node has no associated tree");
-        return *(q->_tree);
+        if (NULL == _top->_tree) throw orphan_exception("tree(): orphan node has no associated tree");
+        return *(_top->_tree);
     }
 
-    size_type depth() const { return _depth.max(); }
-    size_type subtree_size() const { return _size; }
+    size_type depth() const { return height_dispatch_type::depth(*static_cast<const node_type*>(this)); }
+    size_type subtree_size() const { return size_dispatch_type::subtree_size(*static_cast<const node_type*>(this)); }
 
     bool is_root() const { return NULL == _parent; }
 
@@ -147,64 +317,101 @@ struct node_base {
     }
 
     bool operator==(const node_base& rhs) const {
-        if (this == &rhs) return true;
-        if (_children.size() != rhs._children.size()) return false;
-        if (_data != rhs._data) return false;
-        for (const_iterator jL(begin()), jR(rhs.begin());  jL != end();  ++jL,++jR)
-            if (*jL != *jR) return false;
+        // compare corresponding nodes with an explicit stack, so depth is not limited by the call stack
+        typedef pair<const node_base*, const node_base*> frame;
+        typedef typename std::allocator_traits<allocator_type>::template rebind_alloc<frame> frame_allocator;
+        vector<frame, frame_allocator> stack(_children.get_allocator());
+        stack.push_back(frame(this, &rhs));
+        while (!stack.empty()) {
+            frame f = stack.back();
+            stack.pop_back();
+            if (f.first == f.second) continue;
+            if (f.first->_children.size() != f.second->_children.size()) return false;
+            if (f.first->_data != f.second->_data) return false;
+            for (const_iterator jL(f.first->begin()), jR(f.second->begin());  jL != f.first->end();  ++jL,++jR)
+                stack.push_back(frame(&*jL, &*jR));
+        }
         return true;
     }
     bool operator!=(const node_base& rhs) const { return !(*this == rhs); }
 
-    bool operator<(const node_base& rhs) const {
-        if (this == &rhs) return false;
-        if (_data != rhs._data) return (_data < rhs._data);
-        dereferenceable_lessthan<cs_type> lt;
-        return std::lexicographical_compare(_children.begin(), _children.end(), rhs._children.begin(), rhs._children.end(), lt);
-    }
+    bool operator<(const node_base& rhs) const { return _compare(rhs) < 0; }
     bool operator>(const node_base& rhs) const { return rhs < *this; }
     bool operator<=(const node_base& rhs) const { return !(rhs < *this); }
     bool operator>=(const node_base& rhs) const { return !(*this < rhs); }
 
-    friend struct st_tree::tree<data_type, typename Tree::cs_model_type, allocator_type>;
+    friend struct st_tree::tree<data_type, typename Tree::cs_model_type, allocator_type, typename Tree::tracking_type>;
     friend struct b1st_iterator<node_type, node_type, allocator_type>;
     friend struct b1st_iterator<node_type, const node_type, allocator_type>;
     friend struct d1st_post_iterator<node_type, node_type, allocator_type>;
     friend struct d1st_post_iterator<node_type, const node_type, allocator_type>;
     friend struct d1st_pre_iterator<node_type, node_type, allocator_type>;
     friend struct d1st_pre_iterator<node_type, const node_type, allocator_type>;
+    friend struct d1st_walk<node_type>;
+    friend struct erase_walk<node_type>;
 
     protected:
     tree_type* _tree;
-    size_type _size;
     node_type* _parent;
+    // Every node caches its topmost ancestor, which is the only one holding the tree pointer,
+    // and its ply.  Both are re-stamped by _stamp() when a subtree moves.
+    node_type* _top;
+    size_type _ply;
     data_type _data;
     cs_type _children;
-    max_maintainer<size_type, allocator_type> _depth;
+
+    template <typename _Node, bool _Enabled> friend struct size_dispatch;
+    template <typename _Node, bool _Enabled> friend struct height_dispatch;
 
     bool _default_constructed() const {
         return (NULL == _parent) && (NULL == _tree);
     }
 
+    // default-constructed and free-standing nodes are not owned by a tree, so they can only be copied
+    bool _detached() const {
+        return is_root() && ((NULL == _tree) || (_tree->_root != static_cast<const node_type*>(this)));
+    }
+
+    // true if a node can be discarded along with its memory, without running its destructor
+    static bool _trivial_teardown() { return std::is_trivially_destructible<data_type>::value; }
+
+    // nodes can only move between trees whose allocators compare equal
+    bool _same_allocator(const node_type& src) const {
+        return this->tree()._node_allocator == src.tree()._node_allocator;
+    }
+
     iterator _iterator() { return iterator(node_type::_cs_iterator(*static_cast<node_type*>(this))); }
 
     void _erase(const iterator& j) {
         node_type* n = &*j;
         _prune(n);
-        _children.erase(j.base());
-        this->tree()._delete_node(n);
+        static_cast<node_type*>(this)->_renumber(_children.erase(j.base()));
+        this->tree()._reclaim(n);
     }
 
     void _erase(const iterator& F, const iterator& L) {
-        vector<node_type*> d;
+        if (F == L) return;
+        node_type* q = static_cast<node_type*>(this);
+        tree_type& tree_ = this->tree();
+        if (_batching()) {
+            _mark(q);
+            for (iterator j(F);  j != L;  ++j)  tree_._reclaim(&*j);
+            q->_renumber(_children.erase(F.base(), L.base()));
+            return;
+        }
+        // release the nodes in place, tallying what they contributed to their ancestors
+        size_type s = 0;
+        size_type h = 0;
         for (iterator j(F);  j != L;  ++j) {
             node_type* n = &*j;
-            _prune(n);
-            d.push_back(n);
+            s += size_dispatch_type::contribution(*n);
+            if (height_dispatch_type::contribution(*n) > h) h = height_dispatch_type::contribution(*n);
+            tree_._reclaim(n);
         }
-        _children.erase(F.base(), L.base());
-        tree_type& tree_ = this->tree();
-        for (typename vector<node_type*>::iterator e(d.begin());  e != d.end();  ++e) tree_._delete_node(*e);
+        // the whole range is out of the container before heights are recomputed
+        q->_renumber(_children.erase(F.base(), L.base()));
+        size_dispatch_type::prune(q, s);
+        height_dispatch_type::prune(q, h, NULL);
     }
 
     void _erase() {
@@ -213,56 +420,358 @@ struct node_base {
     }
 
     void _prune(node_type* n) {
-        // percolate the new subtree size up the chain of parents
         node_type* q = static_cast<node_type*>(this);
-        size_type dd = 1;
-        while (true) {
-            q->_size -= n->_size;
-            q->_depth.erase(n->_depth, dd);
-            if (q->is_root()) {
-                break;
-            }
-            q = q->_parent;
-            dd += 1;
+        if (_batching()) {
+            _mark(q);
+            return;
         }
+        size_dispatch_type::prune(q, n);
+        height_dispatch_type::prune(q, n);
     }
 
+    // Links the subtree n below this node.  A subtree that lands under another top or at
+    // another ply has every node re-stamped, so such a move costs O(subtree), and building
+    // a deep chain bottom up, by moving it under a new root once per level, is quadratic.
     void _graft(node_type* n) {
         // set new parent for this subtree as current node
         node_type* q = static_cast<node_type*>(this);
         n->_parent = q;
         n->_tree = NULL;
- 
-        // percolate the new subtree size up the chain of parents
-        size_type dd = 1;
+        _stamp(n, q->_top, 1 + q->_ply);
+
+        if (_batching()) {
+            _mark(q);
+            return;
+        }
+        // a subtree that comes from a batch still open elsewhere may carry stale markers
+        _settle(n);
+        // percolate the new subtree size and height up the chain of parents
+        size_dispatch_type::graft(q, n);
+        height_dispatch_type::graft(q, n);
+    }
+
+    // Accounts for n taking the place of o among this node's children, where n is already
+    // linked in o's place.  Heights percolate up if n is taller, and are recomputed if shorter.
+    void _replace(node_type* o, node_type* n) {
+        node_type* q = static_cast<node_type*>(this);
+        n->_parent = q;
+        n->_tree = NULL;
+        _stamp(n, q->_top, 1 + q->_ply);
+
+        if (_batching()) {
+            _mark(q);
+            return;
+        }
+        _settle(n);
+        size_dispatch_type::prune(q, o);
+        size_dispatch_type::graft(q, n);
+        if (height_dispatch_type::contribution(*n) < height_dispatch_type::contribution(*o)) height_dispatch_type::prune(q, height_dispatch_type::contribution(*o), NULL);
+        else height_dispatch_type::graft(q, n);
+    }
+
+    // Appends the leaves that next() makes until it returns NULL, then brings sizes and heights
+    // up to date in one pass up the tree.  Keyed leaves whose keys are taken are discarded.
+    // If making a leaf throws, the leaves already added stay, and are accounted for.
+    template <typename Next>
+    void _append_leaves(Next next) {
+        node_type* q = static_cast<node_type*>(this);
+        tree_type& tree_ = this->tree();
+        node_type* leaf = NULL;
+        size_type k = 0;
+        try {
+            while (node_type* n = next()) {
+                try {
+                    q->_adopt(n);
+                } catch (...) {
+                    tree_._delete_node(n);
+                    throw;
+                }
+                if (!node_type::_linked(n)) {
+                    tree_._delete_node(n);
+                    continue;
+                }
+                n->_parent = q;
+                n->_top = q->_top;
+                n->_ply = 1 + q->_ply;
+                leaf = n;
+                k += 1;
+            }
+        } catch (...) {
+            _account_leaves(leaf, k);
+            throw;
+        }
+        _account_leaves(leaf, k);
+    }
+
+    // k new leaves, of which 'leaf' is one, now hang from this node
+    void _account_leaves(const node_type* leaf, size_type k) {
+        node_type* q = static_cast<node_type*>(this);
+        if (k == 0) return;
+        if (_batching()) {
+            _mark(q);
+            return;
+        }
+        size_dispatch_type::grow(q, k);
+        height_dispatch_type::graft(q, leaf);
+    }
+
+    template <typename InputIter>
+    void _insert_range(InputIter first, InputIter last) {
+        tree_type& tree_ = this->tree();
+        _reserve_range(first, last, typename std::iterator_traits<InputIter>::iterator_category());
+        _append_leaves([&]() -> node_type* {
+            if (first == last) return NULL;
+            node_type* n = tree_._make_node(*first);
+            ++first;
+            return n;
+        });
+    }
+
+    // the child count of a forward range is known up front, so containers can make room once
+    template <typename ForwardIter>
+    void _reserve_range(ForwardIter first, ForwardIter last, std::forward_iterator_tag) {
+        static_cast<node_type*>(this)->_reserve(_children.size() + std::distance(first, last));
+    }
+    template <typename InputIter>
+    void _reserve_range(InputIter, InputIter, std::input_iterator_tag) {}
+
+    // models backed by vectors make room for n children
+    void _reserve(size_type) {}
+
+    // Recomputes the nodes a batch left stale, in the region hanging from r.  Every ancestor
+    // of a stale node is stale, so the region is walked in post-order through parent and
+    // sibling links, resuming each node's scan of its children after the child just settled;
+    // each stale node's children are read twice, and nothing is allocated.
+    static void _settle(node_type* r) {
+        if (!stale_dispatch_type::stale(*r)) return;
+        node_type* q = r;
+        node_type* c = q->empty() ? NULL : &*q->begin();
         while (true) {
-            q->_depth.insert(n->_depth, dd);
-            q->_size += n->_size;
-            if (q->is_root()) {
-                break;
+            while ((NULL != c) && !stale_dispatch_type::stale(*c))  c = _next_sibling(c);
+            if (NULL != c) {
+                q = c;
+                c = q->empty() ? NULL : &*q->begin();
+                continue;
+            }
+            // every child of q is current, so q can be summed from them
+            size_dispatch_type::leaf(*q);
+            height_dispatch_type::leaf(*q);
+            for (iterator j(q->begin());  j != q->end();  ++j) {
+                size_dispatch_type::collect(q, &*j);
+                height_dispatch_type::collect(q, &*j);
             }
+            if (q == r) break;
+            c = _next_sibling(q);
             q = q->_parent;
-            dd += 1;
         }
     }
 
-    static void _thread(node_type* n) {
-        n->_size = 1;
-        for (iterator j(n->begin());  j != n->end();  ++j) {
-            j->_parent = n;
-            node_type* c = &*j;
-            _thread(c);
-            n->_size += j->_size;
+    // Erases the descendants pred matches in one pre-order pass: each container is sifted
+    // once, and nodes that lose children are marked stale.  Inside a batch the marks run up
+    // to the top, for the batch to settle when it commits.  Otherwise they stop at n, which
+    // is settled at the end, and its change in size and height is percolated up from there.
+    template <typename Pred>
+    size_type _erase_if(Pred& pred) {
+        typedef typename std::allocator_traits<allocator_type>::template rebind_alloc<node_type*> frame_allocator;
+        node_type* n = static_cast<node_type*>(this);
+        tree_type& tree_ = this->tree();
+        bool deferred = _batching();
+        node_type* top = deferred ? NULL : n;
+        size_type s = size_dispatch_type::contribution(*n);
+        size_type h = height_dispatch_type::contribution(*n);
+        size_type k = 0;
+        try {
+            vector<node_type*, frame_allocator> stack(_children.get_allocator());
+            stack.push_back(n);
+            while (!stack.empty()) {
+                node_type* q = stack.back();
+                stack.pop_back();
+                size_type m = k;
+                try {
+                    q->_sift(pred, tree_, k);
+                } catch (...) {
+                    if (k > m) _mark(q, top);
+                    throw;
+                }
+                if (k > m) _mark(q, top);
+                for (iterator j(q->begin());  j != q->end();  ++j) {
+                    if (!j->empty()) stack.push_back(&*j);
+                }
+            }
+        } catch (...) {
+            if (!deferred) _shrunk(n, s, h);
+            throw;
+        }
+        if (!deferred) _shrunk(n, s, h);
+        return k;
+    }
+
+    // settles the stale region that ends at n, then passes n's loss of size and height, from
+    // s and h, up through its ancestors, stopping early once heights stop changing
+    static void _shrunk(node_type* n, size_type s, size_type h) {
+        _settle(n);
+        if (n->is_root()) return;
+        if (size_dispatch_type::contribution(*n) < s) size_dispatch_type::prune(n->_parent, s - size_dispatch_type::contribution(*n));
+        if (height_dispatch_type::contribution(*n) < h) height_dispatch_type::prune(n->_parent, h, NULL);
+    }
+
+    // removes and reclaims the children pred matches, counting them in k
+    template <typename Pred>
+    void _sift(Pred& pred, tree_type& tree_, size_type& k) {
+        for (cs_iterator j(_children.begin());  j != _children.end();  ) {
+            node_type* c = &*iterator(j);
+            if (!pred(static_cast<const node_type&>(*c))) {
+                ++j;
+                continue;
+            }
+            j = _children.erase(j);
+            tree_._reclaim(c);
+            k += 1;
         }
     }
 
+    // true while the tree that owns this node has a batch of edits open
+    bool _batching() const {
+        const tree_type* t = _top->_tree;
+        return (NULL != t) && (t->_batch > 0) && (t->_root == _top);
+    }
+
+    // Inside a batch, an edit below q leaves q and its ancestors stale.  Marking stops at the
+    // first node already marked, since everything above that one is marked too, or at top.
+    static void _mark(node_type* q, const node_type* top = NULL) {
+        while (!stale_dispatch_type::stale(*q)) {
+            stale_dispatch_type::mark(*q);
+            if ((q == top) || q->is_root()) break;
+            q = q->_parent;
+        }
+    }
+
+    // Deep copies the subtree at this node into tree_, using an explicit stack in place of
+    // recursion.  The copy comes back fully threaded: parent links, sizes and heights are set.
+    node_type* _copy_data(tree_type& tree_) const {
+        typedef pair<const node_type*, node_type*> frame;
+        typedef typename std::allocator_traits<allocator_type>::template rebind_alloc<frame> frame_allocator;
+        vector<frame, frame_allocator> stack(tree_._node_allocator);
+        node_type* r = static_cast<const node_type*>(this)->_clone(tree_);
+        try {
+            stack.push_back(frame(static_cast<const node_type*>(this), r));
+            while (!stack.empty()) {
+                frame f = stack.back();
+                stack.pop_back();
+                for (const_iterator j(f.first->begin());  j != f.first->end();  ++j) {
+                    node_type* c = j->_clone(tree_);
+                    c->_parent = f.second;
+                    c->_top = r;
+                    c->_ply = 1 + f.second->_ply;
+                    f.second->_adopt(c);
+                    stack.push_back(frame(&*j, c));
+                }
+            }
+        } catch (...) {
+            tree_._delete_node(r);
+            throw;
+        }
+        return r;
+    }
+
+    // Sets the cached top and ply across the subtree at n.  Moves that keep a subtree under
+    // the same top, at the same ply, find nothing to do; otherwise every node is visited once,
+    // in pre-order through parent and sibling links, so a move never allocates.
+    static void _stamp(node_type* n, node_type* top, size_type ply) {
+        if ((n->_top == top) && (n->_ply == ply)) return;
+        n->_top = top;
+        n->_ply = ply;
+        node_type* q = n;
+        while (true) {
+            if (!q->empty()) {
+                node_type* c = &*q->begin();
+                c->_top = top;
+                c->_ply = 1 + q->_ply;
+                q = c;
+                continue;
+            }
+            // climb until some node short of n has a next sibling
+            node_type* s = NULL;
+            while ((q != n) && (NULL == (s = _next_sibling(q))))  q = q->_parent;
+            if (NULL == s) return;
+            s->_top = top;
+            s->_ply = q->_ply;
+            q = s;
+        }
+    }
+
+    // the child after n in its parent's order, or NULL if n is the last one
+    static node_type* _next_sibling(const node_type* n) {
+        node_type* p = n->_parent;
+        cs_iterator j(node_type::_cs_iterator(*const_cast<node_type*>(n)));
+        if (++j == p->_children.end()) return NULL;
+        return &*iterator(j);
+    }
+
+    // models that record each node's position in its parent renumber the children from j onward
+    void _renumber(const cs_iterator&) {}
+
+    // copy of a single node, without its children
+    node_type* _clone(tree_type& tree_) const {
+        node_type* n = tree_._new_node(_data);
+        size_dispatch_type::copy(*n, *static_cast<const node_type*>(this));
+        height_dispatch_type::copy(*n, *static_cast<const node_type*>(this));
+        return n;
+    }
+
+    // a new leaf made from one value of a bulk build, which for most models is its data
+    template <typename Value>
+    static node_type* _make(tree_type& tree_, Value&& v) { return tree_._new_node(std::forward<Value>(v)); }
+
+    // false if _adopt(c) found its place already taken, and left c out of the container
+    static bool _linked(const node_type*) { return true; }
+
+    // Three-way comparison of subtrees: data first, then children lexicographically.
+    // Children pairs are walked with an explicit stack of iterator ranges.
+    int _compare(const node_base& rhs) const {
+        struct frame {
+            const_iterator jL, eL, jR, eR;
+        };
+        typedef typename std::allocator_traits<allocator_type>::template rebind_alloc<frame> frame_allocator;
+        child_key_compare<cs_type> kc;
+        if (this == &rhs) return 0;
+        if (_data != rhs._data) return (_data < rhs._data) ? -1 : ((rhs._data < _data) ? 1 : 0);
+        vector<frame, frame_allocator> stack(_children.get_allocator());
+        frame top = { begin(), end(), rhs.begin(), rhs.end() };
+        stack.push_back(top);
+        while (!stack.empty()) {
+            frame& f = stack.back();
+            if ((f.jL == f.eL) || (f.jR == f.eR)) {
+                // a proper prefix orders first
+                if (f.jR != f.eR) return -1;
+                if (f.jL != f.eL) return 1;
+                stack.pop_back();
+                continue;
+            }
+            int c = kc(f.jL.base(), f.jR.base());
+            if (0 != c) return c;
+            const node_type& a = *(f.jL++);
+            const node_type& b = *(f.jR++);
+            if (&a == &b) continue;
+            if (a._data != b._data) {
+                if (a._data < b._data) return -1;
+                if (b._data < a._data) return 1;
+                continue;
+            }
+            frame next = { a.begin(), a.end(), b.begin(), b.end() };
+            stack.push_back(next);
+        }
+        return 0;
+    }
+
     static void _excise(node_type* n) {
         if (n->is_root()) {
             n->tree()._root = NULL;
             n->tree()._prune(n);
         } else {
-            n->parent()._children.erase(node_type::_cs_iterator(*n));
-            n->parent()._prune(n);
+            node_type& p = n->parent();
+            p._renumber(p._children.erase(node_type::_cs_iterator(*n)));
+            p._prune(n);
         }
     }
 };
@@ -289,13 +798,15 @@ struct node_raw: public node_base<Tree, node_raw<Tree, Data>, vector<node_raw<Tr
     typedef typename base_type::iterator iterator;
     typedef typename base_type::const_iterator const_iterator;
 
-    friend struct st_tree::tree<data_type, typename Tree::cs_model_type, allocator_type>;
+    friend struct st_tree::tree<data_type, typename Tree::cs_model_type, allocator_type, typename Tree::tracking_type>;
     friend struct node_base<Tree, node_type, cs_type>;
 
-    node_raw() : base_type() {}
-    virtual ~node_raw() {}
+    node_raw() : base_type(), _index(0) {}
+    template <typename... Args>
+    explicit node_raw(const typename base_type::cs_allocator_type& a, Args&&... args) : base_type(a, std::forward<Args>(args)...), _index(0) {}
+    ST_TREE_VIRTUAL ~node_raw() = default;
 
-    node_raw(const node_raw& src) : base_type() {
+    node_raw(const node_raw& src) : base_type(), _index(0) {
         // this is to do the right then when calling allocator construct() method
         if (src._default_constructed()) return;
         // otherwise, we'd want "normal" assignment logic
@@ -337,8 +848,7 @@ struct node_raw: public node_base<Tree, node_raw<Tree, Data>, vector<node_raw<Tr
         // do the copying work for children only
         for (cs_const_iterator j(r->_children.begin());  j != r->_children.end();  ++j) {
             node_type* n = (*j)->_copy_data(this->tree());
-            this->_children.push_back(n);
-            base_type::_thread(n);
+            _adopt(n);
             this->_graft(n);
         }
         if (ancestor) this->tree()._delete_node(r);
@@ -353,6 +863,7 @@ struct node_raw: public node_base<Tree, node_raw<Tree, Data>, vector<node_raw<Tr
 
         // this would introduce cycles 
         if (a.is_ancestor(b) || b.is_ancestor(a)) throw cycle_exception("swap(): operation introduces cycle");
+        if (!a._same_allocator(b)) throw exception("swap(): nodes belong to trees with unequal allocators");
 
         tree_type* ta = &a.tree();
         tree_type* tb = &b.tree();
@@ -363,18 +874,29 @@ struct node_raw: public node_base<Tree, node_raw<Tree, Data>, vector<node_raw<Tr
         node_type*& qb = (irb) ? tb->_root : *(node_type::_cs_iterator(b));
         node_type* ra = qa;
         node_type* rb = qb;
+        size_type ia = a._index;
+        size_type ib = b._index;
 
         node_type* pa; if (!a.is_root()) pa = a._parent;
         node_type* pb; if (!b.is_root()) pb = b._parent;
 
-        if (ira) ta->_prune(ra);   else pa->_prune(ra);
-        if (irb) tb->_prune(rb);   else pb->_prune(rb);
-
+        // both slots change hands before any height is recomputed, since a vector slot
+        // cannot be left empty while the other side's chain of parents is rescanned
         qa = rb;
         qb = ra;
-
-        if (ira) ta->_graft(rb);   else pa->_graft(rb);
-        if (irb) tb->_graft(ra);   else pb->_graft(ra);
+        rb->_index = ia;
+        ra->_index = ib;
+
+        // the side gaining height goes first: its parents only grow, which keeps every height
+        // an upper bound for the side that shrinks, as prune's early exit expects
+        typedef typename base_type::height_dispatch_type height_dispatch_type;
+        if (!ira && !irb && (height_dispatch_type::contribution(*ra) > height_dispatch_type::contribution(*rb))) {
+            pb->_replace(rb, ra);
+            pa->_replace(ra, rb);
+            return;
+        }
+        if (ira) ta->_graft(rb);   else pa->_replace(ra, rb);
+        if (irb) tb->_graft(ra);   else pb->_replace(rb, ra);
     }
 
 
@@ -383,12 +905,19 @@ struct node_raw: public node_base<Tree, node_raw<Tree, Data>, vector<node_raw<Tr
         if (this == &src) throw cycle_exception("graft(): operation introduces cycle");
         if (src.is_ancestor(*this)) throw cycle_exception("graft(): operation introduces cycle");
 
+        // nodes cannot migrate to a tree whose allocator did not create them, so copy instead
+        if (!this->_same_allocator(src)) {
+            insert(src);
+            src.erase();
+            return;
+        }
+
         // remove src from its current location
         node_type* s = &src;
         base_type::_excise(s);
 
         // graft src to current location
-        this->_children.push_back(s);
+        _adopt(s);
         this->_graft(s);
     }
 
@@ -408,22 +937,30 @@ struct node_raw: public node_base<Tree, node_raw<Tree, Data>, vector<node_raw<Tr
     void erase(const iterator& j) { this->_erase(j); }
     void erase(const iterator& F, const iterator& L) { this->_erase(F, L); }
 
+    // position of this node among its parent's children
+    size_type index_in_parent() const {
+        if (this->is_root()) throw parent_exception("index_in_parent(): node has no parent");
+        return _index;
+    }
+
     template<class... Args>
     iterator emplace_insert(Args&&... args){
-        node_type* n = this->tree()._new_node();
-        n->_data = data_type(std::forward<Args>(args) ... );
-        n->_depth.insert(1);
-        this->_children.push_back(n);
+        node_type* n = this->tree()._new_node(std::forward<Args>(args)...);
+        _adopt(n);
         this->_graft(n);
         return iterator(this->_children.begin()+(this->_children.size()-1));
     }
 
     iterator insert(const data_type& data) { return emplace_insert(data); }
+    iterator insert(data_type&& data) { return emplace_insert(std::move(data)); }
+
+    // appends a child for each value in [first, last), making room and updating ancestors once
+    template <typename InputIter>
+    void insert(InputIter first, InputIter last) { this->_insert_range(first, last); }
 
     iterator insert(const node_type& src) {
         node_type* n = src._copy_data(this->tree());
-        base_type::_thread(n);
-        this->_children.push_back(n);
+        _adopt(n);
         this->_graft(n);
         return iterator(this->_children.begin()+(this->_children.size()-1));
     }
@@ -432,15 +969,44 @@ struct node_raw: public node_base<Tree, node_raw<Tree, Data>, vector<node_raw<Tr
         return insert(src.root());
     }
 
+    // moves the subtree at src here, relinking its nodes instead of copying them
+    iterator insert(node_type&& src) {
+        if (src._detached()) return insert(static_cast<const node_type&>(src));
+        graft(src);
+        return iterator(this->_children.begin()+(this->_children.size()-1));
+    }
+    iterator insert(tree_type&& src) {
+        if (src.empty()) return this->end();
+        return insert(std::move(src.root()));
+    }
+
     template< class... Args >
     void emplace_back(Args&&... args){ emplace_insert(std::forward<Args>(args) ... ); }
+
+    // appends k children, each constructed from args
+    template <typename... Args>
+    void emplace_back_n(size_type k, const Args&... args) {
+        tree_type& tree_ = this->tree();
+        this->_reserve(this->_children.size() + k);
+        size_type j = 0;
+        this->_append_leaves([&]() -> node_type* {
+            if (j == k) return NULL;
+            ++j;
+            return tree_._new_node(args...);
+        });
+    }
     void push_back(const data_type& data) { insert(data); }
     void push_back(const node_type& src) { insert(src); }
     void push_back(const tree_type& src) { insert(src); }
+    void push_back(data_type&& data) { insert(std::move(data)); }
+    void push_back(node_type&& src) { insert(std::move(src)); }
+    void push_back(tree_type&& src) { insert(std::move(src)); }
 
     void pop_back() {
-        this->tree()._delete_node(this->_children.back());
+        node_type* n = this->_children.back();
+        this->_prune(n);
         this->_children.pop_back();
+        this->tree()._reclaim(n);
     }
 
     node_type& back() { return *(this->_children.back()); }
@@ -452,22 +1018,62 @@ struct node_raw: public node_base<Tree, node_raw<Tree, Data>, vector<node_raw<Tr
     typedef typename base_type::cs_iterator cs_iterator;
     typedef typename base_type::cs_const_iterator cs_const_iterator;
 
+    // each node records its index in the parent's child vector, so its slot is found in O(1)
+    size_type _index;
+
     static cs_iterator _cs_iterator(node_type& n) {
         if (n.is_root()) throw parent_exception("_cs_iterator(): node nas no parent");
-        cs_iterator j(n.parent()._children.begin());
-        cs_iterator jend(n.parent()._children.end());
-        for (;  j != jend;  ++j) if (*j == &n) break;
-        if (j == jend) throw missing_exception("_cs_iterator(): requested node does not exist");
-        return j;
+        cs_type& c = n._parent->_children;
+        if ((n._index >= c.size()) || (c[n._index] != &n)) throw missing_exception("_cs_iterator(): requested node does not exist");
+        return c.begin() + n._index;
+    }
+
+    void _reserve(size_type n) { this->_children.reserve(n); }
+
+    // compacts the kept children to the front of the vector, renumbering them as they move
+    template <typename Pred>
+    void _sift(Pred& pred, tree_type& tree_, size_type& k) {
+        cs_iterator b(this->_children.begin());
+        cs_iterator w(b);
+        cs_iterator r(b);
+        try {
+            for (;  r != this->_children.end();  ++r) {
+                node_type* c = *r;
+                if (pred(static_cast<const node_type&>(*c))) {
+                    tree_._reclaim(c);
+                    k += 1;
+                    continue;
+                }
+                c->_index = w - b;
+                *w++ = c;
+            }
+        } catch (...) {
+            // children not yet tested close the gap left by the ones erased
+            for (;  r != this->_children.end();  ++r, ++w) {
+                (*r)->_index = w - b;
+                *w = *r;
+            }
+            this->_children.erase(w, this->_children.end());
+            throw;
+        }
+        this->_children.erase(w, this->_children.end());
     }
 
-    node_type* _copy_data(tree_type& tree_) const {
-        node_type* n = tree_._new_node();
-        n->_data = this->_data;
-        n->_depth = this->_depth;
-        for (cs_const_iterator j(this->_children.begin()); j != this->_children.end(); ++j)
-            n->_children.push_back((*j)->_copy_data(tree_));
-        return n;
+    void _renumber(const cs_iterator& j) {
+        size_type k = j - this->_children.begin();
+        for (cs_iterator e(this->_children.end()), i(j);  i != e;  ++i,++k)  (*i)->_index = k;
+    }
+
+    void _adopt(node_type* c) {
+        c->_index = this->_children.size();
+        this->_children.push_back(c);
+    }
+
+    // unlinks one child cheaply, for teardown
+    node_type* _take_child() {
+        node_type* c = this->_children.back();
+        this->_children.pop_back();
+        return c;
     }
 };
 
@@ -495,7 +1101,7 @@ struct node_ordered: public node_base<Tree, node_ordered<Tree, Data, Compare>, m
     typedef typename base_type::iterator iterator;
     typedef typename base_type::const_iterator const_iterator;
 
-    friend struct st_tree::tree<data_type, typename Tree::cs_model_type, allocator_type>;
+    friend struct st_tree::tree<data_type, typename Tree::cs_model_type, allocator_type, typename Tree::tracking_type>;
     friend struct node_base<Tree, node_type, cs_type>;
 
     protected:
@@ -503,10 +1109,12 @@ struct node_ordered: public node_base<Tree, node_ordered<Tree, Data, Compare>, m
     typedef typename base_type::cs_const_iterator cs_const_iterator;
 
     public:
-    node_ordered() : base_type() {}
-    virtual ~node_ordered() {}
+    node_ordered() : base_type(), _slot() {}
+    template <typename... Args>
+    explicit node_ordered(const typename base_type::cs_allocator_type& a, Args&&... args) : base_type(a, std::forward<Args>(args)...), _slot() {}
+    ST_TREE_VIRTUAL ~node_ordered() = default;
 
-    node_ordered(const node_ordered& src) : base_type() {
+    node_ordered(const node_ordered& src) : base_type(), _slot() {
         // this is to do the right then when calling allocator construct() method
         if (src._default_constructed()) return;
         // otherwise, we'd want "normal" assignment logic
@@ -556,14 +1164,15 @@ struct node_ordered: public node_base<Tree, node_ordered<Tree, Data, Compare>, m
         // do the copying work for children only
         for (cs_const_iterator j(r->_children.begin());  j != r->_children.end();  ++j) {
             node_type* n = (*j)->_copy_data(this->tree());
-            this->_children.insert(n);
-            base_type::_thread(n);
+            _link(n);
             this->_graft(n);
         }
         if (ancestor) this->tree()._delete_node(r);
 
         if (!this->is_root()) {
-            p->_children.insert(t);
+            p->_link(t);
+            // p's height was recomputed without this node while it was unlinked
+            if (!this->_batching()) base_type::height_dispatch_type::graft(p, t);
         }
 
         return *this;
@@ -577,6 +1186,7 @@ struct node_ordered: public node_base<Tree, node_ordered<Tree, Data, Compare>, m
 
         // this would introduce cycles 
         if (a.is_ancestor(b) || b.is_ancestor(a)) throw cycle_exception("swap(): operation introduces cycle");
+        if (!a._same_allocator(b)) throw exception("swap(): nodes belong to trees with unequal allocators");
 
         bool ira = a.is_root();
         bool irb = b.is_root();
@@ -595,8 +1205,8 @@ struct node_ordered: public node_base<Tree, node_ordered<Tree, Data, Compare>, m
         if (ira) ta->_prune(ra);   else { pa->_children.erase(ja);  pa->_prune(ra); }
         if (irb) tb->_prune(rb);   else { pb->_children.erase(jb);  pb->_prune(rb); }
 
-        if (ira) { ta->_root = rb;  ta->_graft(rb); }   else { pa->_children.insert(rb);  pa->_graft(rb); }
-        if (irb) { tb->_root = ra;  tb->_graft(ra); }   else { pb->_children.insert(ra);  pb->_graft(ra); }
+        if (ira) { ta->_root = rb;  ta->_graft(rb); }   else { pa->_link(rb);  pa->_graft(rb); }
+        if (irb) { tb->_root = ra;  tb->_graft(ra); }   else { pb->_link(ra);  pb->_graft(ra); }
     }
 
 
@@ -605,12 +1215,19 @@ struct node_ordered: public node_base<Tree, node_ordered<Tree, Data, Compare>, m
         if (this == &src) throw cycle_exception("graft(): operation introduces cycle");
         if (src.is_ancestor(*this)) throw cycle_exception("graft(): operation introduces cycle");
 
+        // nodes cannot migrate to a tree whose allocator did not create them, so copy instead
+        if (!this->_same_allocator(src)) {
+            insert(src);
+            src.erase();
+            return;
+        }
+
         // remove src from its current location
         node_type* s = &src;
         base_type::_excise(s);
 
         // graft src to current location
-        this->_children.insert(s);
+        _link(s);
         this->_graft(s);
     }
 
@@ -686,22 +1303,26 @@ struct node_ordered: public node_base<Tree, node_ordered<Tree, Data, Compare>, m
 
     template<class... Args>
     iterator emplace_insert(Args&&... args){
-        node_type* n = this->tree()._new_node();
-        n->_data = data_type(std::forward<Args>(args) ... );
-        iterator r(this->_children.insert(n));
+        node_type* n = this->tree()._new_node(std::forward<Args>(args)...);
+        iterator r(_link(n));
         // insertions always happen for multiset, hence no checking
-        n->_depth.insert(1);
         this->_graft(n);
         return r;
     }
 
     iterator insert(const data_type& data) { return emplace_insert(data); }
+    iterator insert(data_type&& data) { return emplace_insert(std::move(data)); }
+
+    // Inserts a child for each value in [first, last), updating ancestors once.  Each is
+    // placed with a hint at the end, so a sorted range that follows the existing children
+    // is inserted in linear time.
+    template <typename InputIter>
+    void insert(InputIter first, InputIter last) { this->_insert_range(first, last); }
 
     iterator insert(const node_type& src) {
         node_type* n = src._copy_data(this->tree());
-        iterator r(this->_children.insert(n));
+        iterator r(_link(n));
         // insertions always happen for multiset, hence no checking
-        base_type::_thread(n);
         this->_graft(n);
         return r;
     }
@@ -710,28 +1331,43 @@ struct node_ordered: public node_base<Tree, node_ordered<Tree, Data, Compare>, m
         return insert(src.root());
     }
 
+    // moves the subtree at src here, relinking its nodes instead of copying them
+    iterator insert(node_type&& src) {
+        if (src._detached()) return insert(static_cast<const node_type&>(src));
+        if (!this->_same_allocator(src)) {
+            iterator r = insert(static_cast<const node_type&>(src));
+            src.erase();
+            return r;
+        }
+        graft(src);
+        return iterator(node_type::_cs_iterator(src));
+    }
+    iterator insert(tree_type&& src) {
+        if (src.empty()) return this->end();
+        return insert(std::move(src.root()));
+    }
+
 
     protected:
+    // each node records where it sits in the parent's multiset, which stays valid until it is erased
+    cs_iterator _slot;
+
     static cs_iterator _cs_iterator(node_type& n) {
         if (n.is_root()) throw parent_exception("_cs_iterator(): node has no parent");
-        pair<cs_iterator, cs_iterator> r(n.parent()._children.equal_range(&n));
-        if (r.first == r.second) throw missing_exception("_cs_iterator(): requested node does not exist");
-        for (cs_iterator j(r.first);  j != r.second;  ++j)
-            if (*j == &n) return j;
-        throw missing_exception("_cs_iterator(): requested node does not exist");
-        // to satisfy compiler:
-        return r.first;
+        if (*(n._slot) != &n) throw missing_exception("_cs_iterator(): requested node does not exist");
+        return n._slot;
     }
 
-    node_type* _copy_data(tree_type& tree_) const {
-        node_type* n = tree_._new_node();
-        n->_data = this->_data;
-        n->_depth = this->_depth;
-        for (cs_const_iterator j(this->_children.begin());  j != this->_children.end();  ++j) {
-            node_type* c((*j)->_copy_data(tree_));
-            n->_children.insert(c);
-        }
-        return n;
+    cs_iterator _link(node_type* c) { return c->_slot = this->_children.insert(c); }
+
+    void _adopt(node_type* c) { c->_slot = this->_children.insert(this->_children.end(), c); }
+
+    // unlinks one child cheaply, for teardown
+    node_type* _take_child() {
+        cs_iterator j(this->_children.begin());
+        node_type* c = *j;
+        this->_children.erase(j);
+        return c;
     }
 };
 
@@ -761,7 +1397,7 @@ struct node_keyed: public node_base<Tree, node_keyed<Tree, Data, Key, Compare>,
     typedef typename base_type::iterator iterator;
     typedef typename base_type::const_iterator const_iterator;
 
-    friend struct st_tree::tree<data_type, typename Tree::cs_model_type, allocator_type>;
+    friend struct st_tree::tree<data_type, typename Tree::cs_model_type, allocator_type, typename Tree::tracking_type>;
     friend struct node_base<Tree, node_type, cs_type>;
 
     protected:
@@ -769,12 +1405,16 @@ struct node_keyed: public node_base<Tree, node_keyed<Tree, Data, Key, Compare>,
     typedef typename base_type::cs_const_iterator cs_const_iterator;
     typedef typename cs_type::value_type cs_value_type;
     key_type _key;
+    // each node records where it sits in the parent's map, which stays valid until it is erased
+    cs_iterator _slot;
 
     public:
-    node_keyed() : base_type(), _key() {}
-    virtual ~node_keyed() {}
+    node_keyed() : base_type(), _key(), _slot() {}
+    template <typename... Args>
+    explicit node_keyed(const typename base_type::cs_allocator_type& a, Args&&... args) : base_type(a, std::forward<Args>(args)...), _key(), _slot() {}
+    ST_TREE_VIRTUAL ~node_keyed() = default;
 
-    node_keyed(const node_keyed& src) : base_type(), _key() { 
+    node_keyed(const node_keyed& src) : base_type(), _key(), _slot() { 
         // this is to do the right then when calling allocator construct() method
         if (src._default_constructed()) return;
         // otherwise, we'd want "normal" assignment logic
@@ -818,8 +1458,7 @@ struct node_keyed: public node_base<Tree, node_keyed<Tree, Data, Key, Compare>,
         // do the copying work for children only
         for (cs_const_iterator j(r->_children.begin());  j != r->_children.end();  ++j) {
             node_type* n = (j->second)->_copy_data(this->tree());
-            this->_children.insert(cs_value_type(&(n->_key), n));
-            base_type::_thread(n);
+            _link(n);
             this->_graft(n);
         }
         if (ancestor) this->tree()._delete_node(r);
@@ -884,26 +1523,28 @@ struct node_keyed: public node_base<Tree, node_keyed<Tree, Data, Key, Compare>,
 
     template<class... Args>
     pair<iterator, bool> emplace_insert(const key_type& key, Args&&... args){
-        node_type* n = this->tree()._new_node();
+        // look for the key first, so no node is constructed if it is already present
+        cs_iterator j = this->_children.lower_bound(&key);
+        if ((j != this->_children.end()) && !this->_children.key_comp()(&key, j->first)) return pair<iterator, bool>(iterator(j), false);
+        node_type* n = this->tree()._new_node(std::forward<Args>(args)...);
         n->_key = key;
-        pair<cs_iterator, bool> r = this->_children.insert(cs_value_type(&(n->_key), n));
-        pair<iterator, bool> rr(iterator(r.first), r.second);
-        if (!r.second) {
-            // if we did not insert, then bail now
-            this->tree()._delete_node(n);
-            return rr;
-        }
-        // do this work if we know we actually inserted 
-        n->_data = data_type(std::forward<Args>(args) ... );
-        n->_depth.insert(1);
+        n->_slot = j = this->_children.insert(j, cs_value_type(&(n->_key), n));
         this->_graft(n);
-        return rr;
+        return pair<iterator, bool>(iterator(j), true);
     }
 
     pair<iterator, bool> insert(const key_type& key, const data_type& data) { return emplace_insert(key, data); }
+    pair<iterator, bool> insert(const key_type& key, data_type&& data) { return emplace_insert(key, std::move(data)); }
 
     pair<iterator, bool> insert(const kv_pair& kv) { return insert(kv.first, kv.second); }
 
+    // Inserts a child for each (key, data) pair in [first, last) whose key is not already
+    // present, updating ancestors once.  Pairs sorted by key that follow the existing keys
+    // are placed by hint, in linear time.
+    template <typename InputIter>
+    typename std::enable_if<std::is_convertible<decltype(*std::declval<InputIter&>()), kv_pair>::value>::type
+    insert(InputIter first, InputIter last) { this->_insert_range(first, last); }
+
     pair<iterator, bool> insert(const key_type& key, const node_type& src) {
         node_type* n = this->tree()._new_node();
         n->_key = key;
@@ -914,8 +1555,8 @@ struct node_keyed: public node_base<Tree, node_keyed<Tree, Data, Key, Compare>,
             this->tree()._delete_node(n);
             return rr;
         }
+        n->_slot = r.first;
         // if we inserted, then graft the new node in and assign from src
-        n->_depth.insert(1);
         this->_graft(n);
         *n = src;
         return rr;
@@ -926,6 +1567,24 @@ struct node_keyed: public node_base<Tree, node_keyed<Tree, Data, Key, Compare>,
         return insert(key, src.root());
     }
 
+    // moves the subtree at src here, relinking its nodes instead of copying them
+    pair<iterator, bool> insert(const key_type& key, node_type&& src) {
+        if (src._detached()) return insert(key, static_cast<const node_type&>(src));
+        cs_iterator j = this->_children.find(&key);
+        if (j != this->_children.end()) return pair<iterator, bool>(iterator(j), false);
+        if (!this->_same_allocator(src)) {
+            pair<iterator, bool> r = insert(key, static_cast<const node_type&>(src));
+            src.erase();
+            return r;
+        }
+        graft(key, src);
+        return pair<iterator, bool>(iterator(this->_children.find(&key)), true);
+    }
+    pair<iterator, bool> insert(const key_type& key, tree_type&& src) {
+        if (src.empty()) return pair<iterator, bool>(this->end(), false);
+        return insert(key, std::move(src.root()));
+    }
+
     void swap(node_type& b) {
         node_type& a = *this;
 
@@ -933,6 +1592,7 @@ struct node_keyed: public node_base<Tree, node_keyed<Tree, Data, Key, Compare>,
 
         // this would introduce cycles 
         if (a.is_ancestor(b) || b.is_ancestor(a)) throw cycle_exception("swap(): operation introduces cycle");
+        if (!a._same_allocator(b)) throw exception("swap(): nodes belong to trees with unequal allocators");
 
         bool ira = a.is_root();
         bool irb = b.is_root();
@@ -954,8 +1614,8 @@ struct node_keyed: public node_base<Tree, node_keyed<Tree, Data, Key, Compare>,
         // keeping analogous to "raw" semantic where keys don't change
         std::swap(ra->_key, rb->_key);
 
-        if (ira) { ta->_root = rb;  ta->_graft(rb); }   else { pa->_children.insert(cs_value_type(&(rb->_key), rb));  pa->_graft(rb); }
-        if (irb) { tb->_root = ra;  tb->_graft(ra); }   else { pb->_children.insert(cs_value_type(&(ra->_key), ra));  pb->_graft(ra); }
+        if (ira) { ta->_root = rb;  ta->_graft(rb); }   else { pa->_link(rb);  pa->_graft(rb); }
+        if (irb) { tb->_root = ra;  tb->_graft(ra); }   else { pb->_link(ra);  pb->_graft(ra); }
     }
 
 
@@ -964,13 +1624,20 @@ struct node_keyed: public node_base<Tree, node_keyed<Tree, Data, Key, Compare>,
         if (this == &src) throw cycle_exception("graft(): operation introduces cycle");
         if (src.is_ancestor(*this)) throw cycle_exception("graft(): operation introduces cycle");
 
+        // nodes cannot migrate to a tree whose allocator did not create them, so copy instead
+        if (!this->_same_allocator(src)) {
+            insert(key, src);
+            src.erase();
+            return;
+        }
+
         // remove src from its current location
         node_type* s = &src;
         base_type::_excise(s);
 
         // graft src to current location
         s->_key = key;
-        this->_children.insert(cs_value_type(&(s->_key), s));
+        _link(s);
         this->_graft(s);
     }
 
@@ -981,24 +1648,55 @@ struct node_keyed: public node_base<Tree, node_keyed<Tree, Data, Key, Compare>,
 
 
     protected:
+    static bool _trivial_teardown() {
+        return base_type::_trivial_teardown() && std::is_trivially_destructible<key_type>::value;
+    }
+
     static cs_iterator _cs_iterator(node_type& n) {
         if (n.is_root()) throw parent_exception("_cs_iterator(): node has no parent");
-        cs_iterator j(n.parent()._children.find(&n._key));
-        if (j == n.parent()._children.end()) throw missing_exception("_cs_iterator(): requested node does not exist");
-        return j;
+        if (n._slot->second != &n) throw missing_exception("_cs_iterator(): requested node does not exist");
+        return n._slot;
     }
 
-    node_type* _copy_data(tree_type& tree_) const {
-        node_type* n = tree_._new_node();
-        n->_data = this->_data;
+    cs_iterator _link(node_type* c) { return c->_slot = this->_children.insert(cs_value_type(&(c->_key), c)).first; }
+
+    node_type* _clone(tree_type& tree_) const {
+        node_type* n = base_type::_clone(tree_);
         n->_key = this->_key;
-        n->_depth = this->_depth;
-        for (cs_const_iterator j(this->_children.begin());  j != this->_children.end();  ++j) {
-            node_type* c((j->second)->_copy_data(tree_));
-            n->_children.insert(cs_value_type(&(c->_key), c));
+        return n;
+    }
+
+    // keyed nodes are built from (key, data) pairs
+    static node_type* _make(tree_type& tree_, const kv_pair& kv) {
+        node_type* n = tree_._new_node(kv.second);
+        try {
+            n->_key = kv.first;
+        } catch (...) {
+            tree_._delete_node(n);
+            throw;
         }
         return n;
     }
+
+    static bool _linked(const node_type* c) { return c->_slot->second == c; }
+
+    void _adopt(node_type* c) { c->_slot = this->_children.insert(this->_children.end(), cs_value_type(&(c->_key), c)); }
+
+    // unlinks one child cheaply, for teardown
+    node_type* _take_child() {
+        cs_iterator j(this->_children.begin());
+        node_type* c = j->second;
+        this->_children.erase(j);
+        return c;
+    }
+};
+
+
+// gives the free function erase_if() its way into a node's sifting pass
+template <typename Node>
+struct erase_walk {
+    template <typename Pred>
+    static typename Node::size_type run(Node& n, Pred& pred) { return n._erase_if(pred); }
 };
 
 
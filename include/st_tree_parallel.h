@@ -0,0 +1,606 @@
+/******
+st_tree: A highly configurable C++ template tree class, using STL style interfaces.
+
+Copyright (c) 2010-2011 Erik Erlandson
+
+Author:  Erik Erlandson <erikerlandson@yahoo.com>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+******/
+
+#if !defined(__st_tree_parallel_h__)
+#define __st_tree_parallel_h__ 1
+
+// Parallel algorithms over subtrees, and background reclamation.  These run on std::thread,
+// so programs that include this header need to link with the platform's thread library
+// (e.g. -pthread).
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if !defined(__st_tree_h__)
+#include "st_tree.h"
+#endif
+
+namespace st_tree {
+
+// How a parallel algorithm divides its work: the number of threads to run on, where zero
+// means one per hardware thread, and the grain, the largest subtree (counted in nodes) that
+// is handed to a single thread as one task.
+struct parallel_policy {
+    size_t threads;
+    size_t grain;
+
+    parallel_policy(size_t threads_ = 0, size_t grain_ = 1024) : threads(threads_), grain(grain_) {}
+
+    size_t thread_count() const {
+        if (threads > 0) return threads;
+        size_t h = std::thread::hardware_concurrency();
+        return (h > 0) ? h : 1;
+    }
+};
+
+
+namespace detail {
+
+// Runs tasks on a fixed set of threads, each with its own deque of tasks.  A worker takes
+// its newest task from the back of its own deque, and when that is empty it steals the
+// oldest task from the front of another worker's, so thieves take the large tasks split off
+// nearest the top of a subtree.  Tasks may spawn more tasks; run() returns once every task
+// has finished, and rethrows the first exception any of them raised.
+template <typename Task>
+struct work_stealing_pool {
+    explicit work_stealing_pool(size_t threads) : _queues(threads), _pending(0), _failed(false), _error() {}
+
+    size_t size() const { return _queues.size(); }
+
+    // queues t on worker w, which should be the worker that is running the calling task
+    void spawn(size_t w, const Task& t) {
+        _pending.fetch_add(1);
+        std::lock_guard<std::mutex> g(_queues[w].lock);
+        _queues[w].tasks.push_back(t);
+    }
+
+    // runs body(task, worker) for the given tasks and all that they spawn
+    template <typename Body>
+    void run(Body& body) {
+        if (_pending.load() == 0) return;
+        std::vector<std::thread> threads;
+        threads.reserve(_queues.size() - 1);
+        try {
+            for (size_t w = 1;  w < _queues.size();  ++w)  threads.push_back(std::thread(&work_stealing_pool::_work<Body>, this, w, std::ref(body)));
+        } catch (...) {
+            // threads that could not start leave their share of the work to the others
+        }
+        _work(0, body);
+        for (size_t j = 0;  j < threads.size();  ++j)  threads[j].join();
+        if (_error) std::rethrow_exception(_error);
+    }
+
+    protected:
+    struct task_queue {
+        task_queue() : lock(), tasks() {}
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<task_queue> _queues;
+    std::atomic<size_t> _pending;
+    std::atomic<bool> _failed;
+    std::exception_ptr _error;
+    std::mutex _error_lock;
+
+    bool _take(size_t w, Task& t) {
+        {
+            std::lock_guard<std::mutex> g(_queues[w].lock);
+            if (!_queues[w].tasks.empty()) {
+                t = _queues[w].tasks.back();
+                _queues[w].tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1;  k < _queues.size();  ++k) {
+            task_queue& q = _queues[(w + k) % _queues.size()];
+            std::lock_guard<std::mutex> g(q.lock);
+            if (!q.tasks.empty()) {
+                t = q.tasks.front();
+                q.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <typename Body>
+    void _work(size_t w, Body& body) {
+        Task t;
+        // a task is counted as pending until it finishes, which is after it spawns its children
+        while (_pending.load() > 0) {
+            if (!_take(w, t)) {
+                std::this_thread::yield();
+                continue;
+            }
+            // once a task has failed, the rest are drained without running them
+            if (!_failed.load()) {
+                try {
+                    body(t, w);
+                } catch (...) {
+                    std::lock_guard<std::mutex> g(_error_lock);
+                    if (!_error) _error = std::current_exception();
+                    _failed.store(true);
+                }
+            }
+            _pending.fetch_sub(1);
+        }
+    }
+};
+
+
+// the work a subtree represents, used to size tasks: exact when subtree sizes are tracked,
+// otherwise every interior node is taken to be worth a task of its own
+template <typename Node, bool Tracked>
+struct work_dispatch {
+    static size_t work(const Node& n, size_t) { return n.subtree_size(); }
+};
+
+template <typename Node>
+struct work_dispatch<Node, false> {
+    static size_t work(const Node& n, size_t grain) { return n.empty() ? 1 : 1 + grain; }
+};
+
+
+// A task is a run of consecutive siblings.  Siblings whose subtrees fit in the grain are
+// walked serially by the thread that takes the task; larger ones are applied to f and their
+// children are split into new tasks, batched so each covers about a grain's worth of nodes.
+template <typename Node, typename Function>
+struct for_each_body {
+    typedef typename std::remove_const<Node>::type node_type;
+    typedef typename std::conditional<std::is_const<Node>::value, typename node_type::const_iterator, typename node_type::iterator>::type iterator;
+    typedef work_dispatch<node_type, node_type::tree_type::tracking_type::size> work_type;
+
+    struct task {
+        iterator first;
+        iterator last;
+    };
+
+    struct apply_visitor {
+        Function& f;
+        explicit apply_visitor(Function& f_) : f(f_) {}
+        void enter(Node& n, size_t) { f(n); }
+        void exit(Node&, size_t) {}
+    };
+
+    for_each_body(work_stealing_pool<task>& pool_, Function& f_, size_t grain_) : pool(pool_), f(f_), grain(grain_) {}
+
+    work_stealing_pool<task>& pool;
+    Function& f;
+    size_t grain;
+
+    void operator()(const task& t, size_t w) {
+        for (iterator j(t.first);  j != t.last;  ++j) apply(*j, w);
+    }
+
+    void apply(Node& n, size_t w) {
+        if (work_type::work(n, grain) <= grain) {
+            apply_visitor v(f);
+            visit(n, v);
+            return;
+        }
+        f(n);
+        split(n, w);
+    }
+
+    void split(Node& n, size_t w) {
+        task b;
+        b.first = n.begin();
+        size_t acc = 0;
+        for (iterator j(n.begin());  j != n.end();  ) {
+            acc += work_type::work(*j, grain);
+            ++j;
+            if (acc < grain) continue;
+            b.last = j;
+            pool.spawn(w, b);
+            b.first = j;
+            acc = 0;
+        }
+        if (b.first == n.end()) return;
+        b.last = n.end();
+        pool.spawn(w, b);
+    }
+};
+
+
+// A growable array of fold results.  Unlike std::vector it stays contiguous for every result
+// type, bool included, so runs of sibling results can be handed to combine() as R* ranges.
+template <typename R>
+struct fold_stack {
+    fold_stack() : _data(), _size(0), _capacity(0) {}
+
+    size_t size() const { return _size; }
+    R* end() { return _data.get() + _size; }
+
+    void push(R&& r) {
+        if (_size == _capacity) _grow();
+        _data[_size++] = std::move(r);
+    }
+    void pop(size_t k) { _size -= k; }
+
+    protected:
+    std::unique_ptr<R[]> _data;
+    size_t _size;
+    size_t _capacity;
+
+    void _grow() {
+        size_t c = (_capacity > 0) ? 2 * _capacity : 16;
+        std::unique_ptr<R[]> d(new R[c]);
+        for (size_t j = 0;  j < _size;  ++j)  d[j] = std::move(_data[j]);
+        _data.swap(d);
+        _capacity = c;
+    }
+};
+
+
+// Bottom-up evaluation.  Nodes whose subtrees exceed the grain each get a frame, holding a
+// result slot per child and a count of children still pending; everything below them is cut
+// into tasks of sibling subtrees, folded serially.  The thread that brings a frame's count to
+// zero combines its results and passes the value up, so a parent runs as soon as its last
+// child is done, and never waits on a lock.
+template <typename Node, typename LeafFunction, typename CombineFunction, typename R>
+struct fold_body {
+    typedef typename std::remove_const<Node>::type node_type;
+    typedef typename std::conditional<std::is_const<Node>::value, typename node_type::const_iterator, typename node_type::iterator>::type iterator;
+    typedef work_dispatch<node_type, node_type::tree_type::tracking_type::size> work_type;
+
+    struct frame {
+        frame(Node* node_, frame* parent_, size_t index_) : node(node_), parent(parent_), index(index_), pending(node_->size()), results(new R[node_->size()]) {}
+        Node* node;
+        frame* parent;
+        size_t index;
+        std::atomic<size_t> pending;
+        std::unique_ptr<R[]> results;
+    };
+
+    struct task {
+        frame* parent;
+        size_t index;
+        iterator first;
+        iterator last;
+    };
+
+    // post-order serial fold: each node's results are the top entries of the stack when it exits
+    struct fold_visitor {
+        fold_visitor(LeafFunction& leaf_, CombineFunction& combine_) : leaf(leaf_), combine(combine_), stack() {}
+        LeafFunction& leaf;
+        CombineFunction& combine;
+        fold_stack<R> stack;
+        void enter(Node&, size_t) {}
+        void exit(Node& n, size_t) {
+            if (n.empty()) {
+                stack.push(leaf(n));
+                return;
+            }
+            size_t k = n.size();
+            R r = combine(n, stack.end() - k, stack.end());
+            stack.pop(k);
+            stack.push(std::move(r));
+        }
+    };
+
+    fold_body(work_stealing_pool<task>& pool_, LeafFunction& leaf_, CombineFunction& combine_, size_t grain_) :
+        pool(pool_), leaf(leaf_), combine(combine_), grain(grain_), frames(), result() {}
+
+    work_stealing_pool<task>& pool;
+    LeafFunction& leaf;
+    CombineFunction& combine;
+    size_t grain;
+    std::deque<frame> frames;
+    R result;
+
+    R fold(Node& n) {
+        fold_visitor v(leaf, combine);
+        visit(n, v);
+        return std::move(*(v.stack.end() - 1));
+    }
+
+    void operator()(const task& t, size_t) {
+        fold_visitor v(leaf, combine);
+        size_t k = 0;
+        for (iterator j(t.first);  j != t.last;  ++j, ++k) {
+            visit(*j, v);
+            t.parent->results[t.index + k] = std::move(*(v.stack.end() - 1));
+            v.stack.pop(1);
+        }
+        complete(t.parent, k);
+    }
+
+    void complete(frame* f, size_t k) {
+        if (f->pending.fetch_sub(k) != k) return;
+        // the last child in combines the frame, and carries on up while it keeps finishing parents
+        while (true) {
+            size_t c = f->node->size();
+            R r = combine(*(f->node), f->results.get(), f->results.get() + c);
+            if (f->parent == NULL) {
+                result = std::move(r);
+                return;
+            }
+            f->parent->results[f->index] = std::move(r);
+            f = f->parent;
+            if (f->pending.fetch_sub(1) != 1) return;
+        }
+    }
+
+    // lays out frames for every node above the grain, and queues tasks for what lies below them
+    void plan(Node& n) {
+        std::vector<frame*> stack;
+        frames.emplace_back(&n, static_cast<frame*>(NULL), 0);
+        stack.push_back(&frames.back());
+        while (!stack.empty()) {
+            frame* f = stack.back();
+            stack.pop_back();
+            task b = task();
+            b.parent = f;
+            size_t acc = 0;
+            size_t i = 0;
+            for (iterator j(f->node->begin());  j != f->node->end();  ++j, ++i) {
+                size_t w = work_type::work(*j, grain);
+                if (w > grain) {
+                    if (acc > 0) _queue(b, j);
+                    acc = 0;
+                    frames.emplace_back(&*j, f, i);
+                    stack.push_back(&frames.back());
+                    continue;
+                }
+                if (acc == 0) {
+                    b.index = i;
+                    b.first = j;
+                }
+                acc += w;
+                if (acc < grain) continue;
+                iterator e(j);
+                _queue(b, ++e);
+                acc = 0;
+            }
+            if (acc > 0) _queue(b, f->node->end());
+        }
+    }
+
+    void _queue(task& b, const iterator& last) {
+        b.last = last;
+        pool.spawn(0, b);
+    }
+};
+} // namespace detail
+
+
+// Applies f to every node in the subtree at n, in no particular order, spreading the work
+// across threads.  Subtree sizes split it into tasks of about policy.grain nodes each, which
+// run on a work-stealing pool of policy.thread_count() threads, the calling thread included.
+// f may run concurrently on different nodes, and must not add or remove nodes.  If f throws,
+// the remaining tasks are abandoned and the first exception is rethrown.
+template <typename Node, typename Function>
+void parallel_for_each(Node& n, Function f, const parallel_policy& policy = parallel_policy()) {
+    typedef detail::for_each_body<Node, Function> body_type;
+    detail::work_stealing_pool<typename body_type::task> pool(policy.thread_count());
+    body_type body(pool, f, (policy.grain > 0) ? policy.grain : 1);
+    if ((pool.size() <= 1) || (body_type::work_type::work(n, body.grain) <= body.grain)) {
+        typename body_type::apply_visitor v(f);
+        visit(n, v);
+        return;
+    }
+    f(n);
+    body.split(n, 0);
+    pool.run(body);
+}
+
+template <typename Data, typename CSModel, typename Alloc, typename Tracking, typename Function>
+void parallel_for_each(tree<Data, CSModel, Alloc, Tracking>& t, Function f, const parallel_policy& policy = parallel_policy()) {
+    if (!t.empty()) parallel_for_each(t.root(), f, policy);
+}
+
+template <typename Data, typename CSModel, typename Alloc, typename Tracking, typename Function>
+void parallel_for_each(const tree<Data, CSModel, Alloc, Tracking>& t, Function f, const parallel_policy& policy = parallel_policy()) {
+    if (!t.empty()) parallel_for_each(t.root(), f, policy);
+}
+
+
+// Evaluates the subtree at n bottom up, in parallel: each leaf's value is leaf(leaf_node), and
+// each interior node's is combine(node, first, last), where [first, last) holds its children's
+// values in child order, as an array of R that combine() may move from.  R is the type leaf()
+// returns, and must be default constructible and move assignable.  Independent subtrees are
+// folded concurrently, and a node is combined by whichever thread finishes its last child.
+template <typename Node, typename LeafFunction, typename CombineFunction>
+typename std::decay<decltype(std::declval<LeafFunction&>()(std::declval<Node&>()))>::type
+parallel_fold(Node& n, LeafFunction leaf, CombineFunction combine, const parallel_policy& policy = parallel_policy()) {
+    typedef typename std::decay<decltype(leaf(n))>::type result_type;
+    typedef detail::fold_body<Node, LeafFunction, CombineFunction, result_type> body_type;
+    detail::work_stealing_pool<typename body_type::task> pool(policy.thread_count());
+    body_type body(pool, leaf, combine, (policy.grain > 0) ? policy.grain : 1);
+    if ((pool.size() <= 1) || (body_type::work_type::work(n, body.grain) <= body.grain)) return body.fold(n);
+    body.plan(n);
+    pool.run(body);
+    return std::move(body.result);
+}
+
+template <typename Data, typename CSModel, typename Alloc, typename Tracking, typename LeafFunction, typename CombineFunction>
+typename std::decay<decltype(std::declval<LeafFunction&>()(std::declval<typename tree<Data, CSModel, Alloc, Tracking>::node_type&>()))>::type
+parallel_fold(tree<Data, CSModel, Alloc, Tracking>& t, LeafFunction leaf, CombineFunction combine, const parallel_policy& policy = parallel_policy()) {
+    return parallel_fold(t.root(), leaf, combine, policy);
+}
+
+template <typename Data, typename CSModel, typename Alloc, typename Tracking, typename LeafFunction, typename CombineFunction>
+typename std::decay<decltype(std::declval<LeafFunction&>()(std::declval<const typename tree<Data, CSModel, Alloc, Tracking>::node_type&>()))>::type
+parallel_fold(const tree<Data, CSModel, Alloc, Tracking>& t, LeafFunction leaf, CombineFunction combine, const parallel_policy& policy = parallel_policy()) {
+    return parallel_fold(t.root(), leaf, combine, policy);
+}
+
+// Releases a tree's erased subtrees on a thread of its own, so that erase() and clear() on the
+// tree's thread only unlink them.  The tree defers reclamation while the reclaimer exists; the
+// reclaimer wakes every interval, or when wake() is called, to release whatever is queued, and
+// flush() waits until everything erased so far has been released.  Node data is destroyed on
+// the reclaimer's thread, through the tree's allocator, which must allow allocations from other
+// threads at the same time; only stateless allocators such as std::allocator are taken to do so.
+// A reclaimer must be destroyed before its tree.
+template <typename Tree>
+struct background_reclaimer {
+    static_assert(detail::pool_dispatch<typename Tree::node_allocator_type>::concurrent,
+                  "background_reclaimer: the tree's allocator is stateful, and may not serve two threads at once");
+
+    explicit background_reclaimer(Tree& t, std::chrono::milliseconds interval = std::chrono::milliseconds(10)) :
+        _tree(t), _interval(interval), _lock(), _wake(), _stop(false), _thread() {
+        _tree.defer_reclamation(true);
+        _thread = std::thread(&background_reclaimer::_run, this);
+    }
+
+    ~background_reclaimer() {
+        {
+            std::lock_guard<std::mutex> g(_lock);
+            _stop = true;
+        }
+        _wake.notify_one();
+        _thread.join();
+        _tree.defer_reclamation(false);
+        _tree.flush();
+    }
+
+    // asks for the queue to be released now, without waiting for it
+    void wake() { _wake.notify_one(); }
+
+    // releases everything queued so far before returning, on the calling thread if need be
+    void flush() {
+        std::lock_guard<std::mutex> g(_lock);
+        _tree.flush();
+    }
+
+    protected:
+    Tree& _tree;
+    std::chrono::milliseconds _interval;
+    std::mutex _lock;
+    std::condition_variable _wake;
+    bool _stop;
+    std::thread _thread;
+
+    // the lock is held while releasing, so flush() cannot return while a batch is in flight
+    void _run() {
+        std::unique_lock<std::mutex> g(_lock);
+        while (!_stop) {
+            _tree.flush();
+            _wake.wait_for(g, _interval);
+        }
+    }
+
+    private:
+    background_reclaimer(const background_reclaimer&);
+    background_reclaimer& operator=(const background_reclaimer&);
+};
+
+
+// Makes this tree a deep copy of src, as operator= does, with parallel_fold doing the work:
+// subtrees below the grain are each copied by one thread, and a node's copy adopts its
+// children's copies, in order, on whichever thread finishes the last of them.  Sizes, heights
+// and cached plies are set as each node is made, so nothing is walked again afterwards.
+// Threads allocate through the tree's allocator at the same time, which std::allocator allows;
+// a pooled<> tree's node_pool serves one thread only, so those trees are copied serially.
+// If a copy throws, the nodes copied so far are released and this tree keeps its old contents.
+template <typename Data, typename CSModel, typename Alloc, typename Tracking>
+void tree<Data, CSModel, Alloc, Tracking>::copy_from(const tree_type& src, const parallel_policy& policy) {
+    if (&src == this) return;
+
+    // nodes must be released by the allocator that created them
+    if (node_alloc_traits::propagate_on_container_copy_assignment::value) {
+        clear();
+        flush();
+        _node_allocator = src._node_allocator;
+    }
+
+    if (src.empty()) {
+        clear();
+        return;
+    }
+
+    if (!pool_dispatch::concurrent || (policy.thread_count() <= 1)) {
+        insert(src.root());
+        return;
+    }
+
+    // a finished copy of a subtree, not yet adopted by its parent's copy
+    struct owned {
+        owned() : t(NULL), n(NULL) {}
+        owned(tree* t_, node_type* n_) : t(t_), n(n_) {}
+        owned(owned&& src) : t(src.t), n(src.n) { src.n = NULL; }
+        owned& operator=(owned&& src) {
+            if (&src == this) return *this;
+            reset();
+            t = src.t;
+            n = src.n;
+            src.n = NULL;
+            return *this;
+        }
+        ~owned() { reset(); }
+        void reset() {
+            if (NULL != n) t->_delete_node(n);
+            n = NULL;
+        }
+        tree* t;
+        node_type* n;
+    };
+
+    // the top of the copy is made first, so that every node can be stamped with it
+    const node_type* s0 = &src.root();
+    owned r(this, s0->_clone(*this));
+    node_type* top = r.n;
+    top->_top = top;
+    top->_ply = 0;
+
+    tree* t = this;
+    auto leaf = [t, top, s0](const node_type& s) -> owned {
+        if (&s == s0) return owned();
+        owned c(t, s._clone(*t));
+        c.n->_top = top;
+        c.n->_ply = s._ply;
+        return c;
+    };
+    auto combine = [t, top, s0](const node_type& s, owned* first, owned* last) -> owned {
+        owned c;
+        node_type* q = top;
+        if (&s != s0) {
+            c = owned(t, s._clone(*t));
+            q = c.n;
+            q->_top = top;
+            q->_ply = s._ply;
+        }
+        for (;  first != last;  ++first) {
+            q->_adopt(first->n);
+            first->n->_parent = q;
+            first->n = NULL;
+        }
+        return c;
+    };
+    parallel_fold(*s0, leaf, combine, policy);
+
+    clear();
+    _root = r.n;
+    r.n = NULL;
+    _graft(_root);
+}
+
+}  // namespace st_tree
+
+#endif  // __st_tree_parallel_h__
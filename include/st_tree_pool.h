@@ -0,0 +1,261 @@
+/******
+st_tree: A highly configurable C++ template tree class, using STL style interfaces.
+
+Copyright (c) 2010-2011 Erik Erlandson
+
+Author:  Erik Erlandson <erikerlandson@yahoo.com>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+******/
+
+#if !defined(__st_tree_pool_h__)
+#define __st_tree_pool_h__ 1
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+#if !defined(__st_tree_detail_h__)
+#include "st_tree_detail.h"
+#endif
+
+namespace st_tree {
+
+namespace detail {
+template <typename Alloc> struct pool_dispatch;
+}
+
+// Carves small blocks out of large slabs, and recycles freed blocks through
+// per-size free lists.  Blocks too large for a free list go straight to operator new,
+// but are still tracked, so that release() can return every byte at once.
+// A node_pool is not thread safe: it is intended to serve exactly one tree.
+struct node_pool {
+    typedef size_t size_type;
+
+    explicit node_pool(size_type slab_bytes = 64 * 1024) :
+        _slab_bytes(slab_bytes), _slabs(NULL), _large(NULL), _cur(NULL), _end(NULL), _reserved(0), _trees(0), _live(0) {
+        for (size_type c = 0;  c < _classes;  ++c) _free[c] = NULL;
+    }
+    ~node_pool() { release(); }
+
+    void* allocate(size_type bytes) {
+        if (bytes > _max_small) return _allocate_large(bytes);
+        size_type c = _class(bytes);
+        if (NULL != _free[c]) {
+            block* b = _free[c];
+            _free[c] = b->next;
+            return b;
+        }
+        size_type n = (c + 1) * _align;
+        if ((_cur + n) > _end) _new_slab();
+        void* r = _cur;
+        _cur += n;
+        return r;
+    }
+
+    void deallocate(void* p, size_type bytes) {
+        if (NULL == p) return;
+        if (bytes > _max_small) {
+            _reserved -= _large_header + bytes;
+            _deallocate_large(p);
+            return;
+        }
+        size_type c = _class(bytes);
+        block* b = static_cast<block*>(p);
+        b->next = _free[c];
+        _free[c] = b;
+    }
+
+    // returns all memory to the system, whether or not it is still in use
+    void release() {
+        while (NULL != _slabs) {
+            slab* s = _slabs;
+            _slabs = s->next;
+            ::operator delete(s);
+        }
+        while (NULL != _large) {
+            large* l = _large;
+            _large = l->next;
+            ::operator delete(l);
+        }
+        for (size_type c = 0;  c < _classes;  ++c) _free[c] = NULL;
+        _cur = _end = NULL;
+        _reserved = 0;
+        _live = 0;
+    }
+
+    // total bytes currently obtained from operator new
+    size_type reserved() const { return _reserved; }
+
+    template <typename _Alloc> friend struct detail::pool_dispatch;
+
+    protected:
+    struct block { block* next; };
+    struct slab { slab* next; };
+    struct large { large* prev; large* next; };
+
+    static const size_type _align = alignof(std::max_align_t);
+    static const size_type _classes = 32;
+    static const size_type _max_small = _classes * _align;
+    // headers are padded so the memory that follows them stays maximally aligned
+    static const size_type _slab_header = ((sizeof(slab) + _align - 1) / _align) * _align;
+    static const size_type _large_header = ((sizeof(large) + _align - 1) / _align) * _align;
+
+    size_type _slab_bytes;
+    slab* _slabs;
+    large* _large;
+    char* _cur;
+    char* _end;
+    size_type _reserved;
+    block* _free[_classes];
+
+    // number of trees attached to this pool, and number of their nodes it currently holds
+    size_type _trees;
+    size_type _live;
+
+    static size_type _class(size_type bytes) {
+        return (bytes <= 0) ? 0 : (bytes - 1) / _align;
+    }
+
+    void _new_slab() {
+        size_type n = (_slab_bytes < (_slab_header + _max_small)) ? (_slab_header + _max_small) : _slab_bytes;
+        char* m = static_cast<char*>(::operator new(n));
+        slab* s = reinterpret_cast<slab*>(m);
+        s->next = _slabs;
+        _slabs = s;
+        _reserved += n;
+        _cur = m + _slab_header;
+        _end = m + n;
+    }
+
+    void* _allocate_large(size_type bytes) {
+        char* m = static_cast<char*>(::operator new(_large_header + bytes));
+        large* l = reinterpret_cast<large*>(m);
+        l->prev = NULL;
+        l->next = _large;
+        if (NULL != _large) _large->prev = l;
+        _large = l;
+        _reserved += _large_header + bytes;
+        return m + _large_header;
+    }
+
+    void _deallocate_large(void* p) {
+        large* l = reinterpret_cast<large*>(static_cast<char*>(p) - _large_header);
+        if (NULL != l->prev) l->prev->next = l->next;
+        else _large = l->next;
+        if (NULL != l->next) l->next->prev = l->prev;
+        ::operator delete(l);
+    }
+
+    private:
+    node_pool(const node_pool&);
+    node_pool& operator=(const node_pool&);
+};
+
+
+// An allocator that draws from a node_pool.  A tree declared with a pooled<>
+// allocator creates its own private pool, which is released in bulk when the tree
+// is cleared, provided the data (and key) types are trivially destructible.
+// A default-constructed pooled<> that is not attached to a tree falls back on operator new.
+template <typename T>
+struct pooled {
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef st_tree::detail::difference_type difference_type;
+
+    // copies of a tree get their own pool, and a pool travels with its nodes on swap
+    typedef std::false_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    template <typename U> struct rebind { typedef pooled<U> other; };
+
+    pooled() : _pool(NULL) {}
+    template <typename U>
+    pooled(const pooled<U>& src) : _pool(src.pool()) {}
+
+    pooled select_on_container_copy_construction() const { return pooled(); }
+
+    T* allocate(size_type n) {
+        if ((NULL == _pool) || (alignof(T) > alignof(std::max_align_t))) return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(_pool->allocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_type n) {
+        if ((NULL == _pool) || (alignof(T) > alignof(std::max_align_t))) ::operator delete(p);
+        else _pool->deallocate(p, n * sizeof(T));
+    }
+
+    node_pool* pool() const { return _pool; }
+
+    template <typename U>
+    bool operator==(const pooled<U>& rhs) const { return _pool == rhs.pool(); }
+    template <typename U>
+    bool operator!=(const pooled<U>& rhs) const { return _pool != rhs.pool(); }
+
+    template <typename _Alloc> friend struct detail::pool_dispatch;
+
+    protected:
+    node_pool* _pool;
+};
+
+
+namespace detail {
+
+// Hooks that let a tree manage the lifetime of an allocator's pool.
+// The default is for allocators without one: all no-ops.
+template <typename Alloc>
+struct pool_dispatch {
+    // whether several threads may allocate through copies of the allocator at once: assumed
+    // only for stateless allocators such as std::allocator, since a stateful one (an arena,
+    // say) may keep unsynchronized state that its copies share
+    static const bool concurrent = std::allocator_traits<Alloc>::is_always_equal::value;
+    static void attach(Alloc&) {}
+    static void detach(Alloc&) {}
+    static void count(Alloc&, difference_type) {}
+    static bool release(Alloc&, size_t) { return false; }
+};
+
+template <typename T>
+struct pool_dispatch<pooled<T> > {
+    static const bool concurrent = false;
+    static void attach(pooled<T>& a) {
+        if (NULL == a._pool) a._pool = new node_pool();
+        a._pool->_trees += 1;
+    }
+    static void detach(pooled<T>& a) {
+        if (NULL == a._pool) return;
+        a._pool->_trees -= 1;
+        if (a._pool->_trees <= 0) delete a._pool;
+        a._pool = NULL;
+    }
+    static void count(pooled<T>& a, difference_type d) {
+        if (NULL != a._pool) a._pool->_live += d;
+    }
+    // Only safe if this pool serves a single tree, and every node it holds
+    // belongs to that tree (free-standing node copies may hold pool nodes too)
+    static bool release(pooled<T>& a, size_t nodes) {
+        if ((NULL == a._pool) || (a._pool->_trees != 1) || (a._pool->_live != nodes)) return false;
+        a._pool->release();
+        return true;
+    }
+};
+
+} // namespace detail
+} // namespace st_tree
+
+#endif
@@ -0,0 +1,372 @@
+#include <boost/test/unit_test.hpp>
+
+#include "st_tree.h"
+#include "ut_common.h"
+
+#include <utility>
+
+
+BOOST_AUTO_TEST_SUITE(ut_alloc)
+
+
+// running total of allocate() calls, across all counters and all element types
+struct allocation_tally {
+    static long& allocations() {
+        static long a = 0;
+        return a;
+    }
+};
+
+// a stateful allocator that tallies outstanding allocations in a caller supplied counter
+template <typename T>
+struct counting_allocator : public allocation_tally {
+    typedef T value_type;
+
+    static long& default_count() {
+        static long c = 0;
+        return c;
+    }
+
+    counting_allocator() : _count(&default_count()) {}
+    explicit counting_allocator(long* c) : _count(c) {}
+    template <typename U>
+    counting_allocator(const counting_allocator<U>& src) : _count(src._count) {}
+
+    T* allocate(size_t n) {
+        *_count += 1;
+        allocations() += 1;
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t) {
+        *_count -= 1;
+        ::operator delete(p);
+    }
+
+    template <typename U>
+    bool operator==(const counting_allocator<U>& rhs) const { return _count == rhs._count; }
+    template <typename U>
+    bool operator!=(const counting_allocator<U>& rhs) const { return _count != rhs._count; }
+
+    long* _count;
+};
+
+
+BOOST_AUTO_TEST_CASE(raw_allocator) {
+    long c = 0;
+    long d = counting_allocator<int>::default_count();
+    {
+        tree<int, raw<>, counting_allocator<int> > t1((counting_allocator<int>(&c)));
+        t1.insert(1);
+        t1.root().insert(2);
+        t1.root().insert(3);
+        t1.root()[0].insert(4);
+        BOOST_CHECK(c > 0);
+        BOOST_CHECK(t1.get_allocator() == counting_allocator<int>(&c));
+        BOOST_CHECK_EQUAL(counting_allocator<int>::default_count(), d);
+
+        t1.root().erase(t1.root().begin());
+        BOOST_CHECK_EQUAL(t1.size(), 2);
+        BOOST_CHECK(c > 0);
+
+        t1.clear();
+        BOOST_CHECK_EQUAL(c, 0);
+
+        t1.insert(5);
+        t1.root().insert(6);
+    }
+    BOOST_CHECK_EQUAL(c, 0);
+    BOOST_CHECK_EQUAL(counting_allocator<int>::default_count(), d);
+}
+
+
+BOOST_AUTO_TEST_CASE(ordered_allocator) {
+    long c = 0;
+    long d = counting_allocator<int>::default_count();
+    {
+        tree<int, ordered<>, counting_allocator<int> > t1((counting_allocator<int>(&c)));
+        t1.insert(1);
+        t1.root().insert(3);
+        t1.root().insert(2);
+        t1.root().begin()->insert(4);
+        BOOST_CHECK(c > 0);
+        BOOST_CHECK_EQUAL(counting_allocator<int>::default_count(), d);
+        CHECK_TREE(t1, data(), "1 2 3 4");
+
+        tree<int, ordered<>, counting_allocator<int> > t2(t1);
+        BOOST_CHECK(t2 == t1);
+        BOOST_CHECK(t2.get_allocator() == counting_allocator<int>(&c));
+    }
+    BOOST_CHECK_EQUAL(c, 0);
+    BOOST_CHECK_EQUAL(counting_allocator<int>::default_count(), d);
+}
+
+
+BOOST_AUTO_TEST_CASE(teardown_allocates_nothing) {
+    long c = 0;
+    tree<int, ordered<>, counting_allocator<int> > t1((counting_allocator<int>(&c)));
+    t1.insert(0);
+    for (int j = 0;  j < 10;  ++j) {
+        t1.root().insert(j);
+        for (int k = 0;  k < 10;  ++k) t1.root().find(j)->insert(k);
+    }
+    BOOST_CHECK_EQUAL(t1.size(), 111);
+
+    long a = counting_allocator<int>::allocations();
+    t1.root().erase(t1.root().lower_bound(3), t1.root().upper_bound(6));
+    BOOST_CHECK_EQUAL(t1.size(), 67);
+    BOOST_CHECK_EQUAL(t1.depth(), 3);
+    t1.clear();
+    BOOST_CHECK_EQUAL(counting_allocator<int>::allocations(), a);
+    BOOST_CHECK_EQUAL(c, 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(leaf_insert_allocates_node_only) {
+    typedef tree<int, raw<>, counting_allocator<int> > tree_t;
+    long c = 0;
+    tree_t t1((counting_allocator<int>(&c)));
+    t1.insert(0);
+
+    // linking a new leaf allocates the node, and nothing else beyond the child vector's growth
+    long a = counting_allocator<int>::allocations();
+    for (int j = 0;  j < 1000;  ++j) t1.root().insert(j);
+    BOOST_CHECK(counting_allocator<int>::allocations() - a < 1000 + 20);
+
+    // moving a subtree re-stamps it without allocating
+    for (int j = 0;  j < 10;  ++j) t1.root()[j].insert(j)->insert(j);
+    a = counting_allocator<int>::allocations();
+    t1.root()[999].graft(t1.root()[0]);
+    BOOST_CHECK(counting_allocator<int>::allocations() - a <= 1);
+    BOOST_CHECK_EQUAL(t1.root()[998][0][0][0].ply(), 4);
+}
+
+
+BOOST_AUTO_TEST_CASE(traversal_end_allocates_nothing) {
+    typedef tree<int, raw<>, counting_allocator<int> > tree_t;
+    long c = 0;
+    tree_t t1((counting_allocator<int>(&c)));
+    t1.insert(0);
+    for (int j = 0;  j < 10;  ++j) {
+        t1.root().insert(j);
+        for (int k = 0;  k < 10;  ++k) t1.root()[j].insert(k);
+    }
+
+    // end iterators are an empty state, compared without copying or allocating
+    long a = counting_allocator<int>::allocations();
+    int n = 0;
+    for (tree_t::df_pre_iterator j(t1.df_pre_begin());  j != t1.df_pre_end();  ++j) n += 1;
+    for (tree_t::df_post_iterator j(t1.df_post_begin());  j != t1.df_post_end();  ++j) n += 1;
+    BOOST_CHECK_EQUAL(counting_allocator<int>::allocations(), a);
+    BOOST_CHECK(t1.bf_end() == t1.bf_end());
+    BOOST_CHECK_EQUAL(counting_allocator<int>::allocations(), a);
+
+    // only the breadth-first queue itself allocates, as it grows
+    for (tree_t::bf_iterator j(t1.bf_begin());  j != t1.bf_end();  ++j) n += 1;
+    BOOST_CHECK_EQUAL(n, 3 * 111);
+    BOOST_CHECK(counting_allocator<int>::allocations() - a < 20);
+}
+
+
+BOOST_AUTO_TEST_CASE(traversal_context_reuse) {
+    typedef tree<int, raw<>, counting_allocator<int> > tree_t;
+    long c = 0;
+    tree_t t1((counting_allocator<int>(&c)));
+    t1.insert(0);
+    for (int j = 0;  j < 10;  ++j) {
+        t1.root().insert(j);
+        for (int k = 0;  k < 10;  ++k) t1.root()[j].insert(k);
+    }
+
+    tree_t::traversal_context ctx;
+    int n = 0;
+    for (tree_t::bf_iterator j(t1.bf_begin(ctx));  j != t1.bf_end();  ++j) n += 1;
+    BOOST_CHECK_EQUAL(n, 111);
+    BOOST_CHECK(ctx.capacity() > 0);
+
+    // once the context's queue has grown, later traversals run without allocating
+    long a = counting_allocator<int>::allocations();
+    for (int r = 0;  r < 10;  ++r) {
+        n = 0;
+        for (tree_t::bf_iterator j(t1.bf_begin(ctx));  j != t1.bf_end();  ++j) n += 1;
+        BOOST_CHECK_EQUAL(n, 111);
+        const tree_t::node_type& q = t1.root()[3];
+        n = 0;
+        for (tree_t::const_bf_iterator j(q.bf_begin(ctx));  j != q.bf_end();  ++j) n += j->data();
+        BOOST_CHECK_EQUAL(n, 3 + 45);
+    }
+    BOOST_CHECK_EQUAL(counting_allocator<int>::allocations(), a);
+
+    // a copy of an iterator on a context owns its own queue
+    tree_t::bf_iterator j(t1.bf_begin(ctx));
+    ++j;
+    tree_t::bf_iterator k(j);
+    ++j;
+    BOOST_CHECK_EQUAL(k->data(), 0);
+    BOOST_CHECK_EQUAL(j->data(), 1);
+    ++k;
+    BOOST_CHECK(k == j);
+
+    // a moved iterator keeps running on the context, and the moved-from one is at the end
+    a = counting_allocator<int>::allocations();
+    tree_t::bf_iterator m(std::move(j));
+    BOOST_CHECK(j == t1.bf_end());
+    n = 0;
+    for (;  m != t1.bf_end();  ++m) n += 1;
+    BOOST_CHECK_EQUAL(n, 111 - 2);
+    j = t1.bf_begin(ctx);
+    m = std::move(j);
+    BOOST_CHECK_EQUAL(m->data(), 0);
+    BOOST_CHECK_EQUAL(counting_allocator<int>::allocations(), a);
+}
+
+
+BOOST_AUTO_TEST_CASE(keyed_allocator) {
+    long c = 0;
+    long d = counting_allocator<int>::default_count();
+    {
+        tree<int, keyed<string>, counting_allocator<int> > t1((counting_allocator<int>(&c)));
+        t1.insert(1);
+        t1.root().insert("a", 2);
+        t1.root().insert("b", 3);
+        t1.root()["a"].insert("c", 4);
+        BOOST_CHECK(c > 0);
+        BOOST_CHECK_EQUAL(counting_allocator<int>::default_count(), d);
+        CHECK_TREE(t1, data(), "1 2 3 4");
+
+        t1.root().erase("a");
+        CHECK_TREE(t1, data(), "1 3");
+    }
+    BOOST_CHECK_EQUAL(c, 0);
+    BOOST_CHECK_EQUAL(counting_allocator<int>::default_count(), d);
+}
+
+
+BOOST_AUTO_TEST_CASE(pooled_bulk_clear) {
+    typedef tree<int, raw<>, pooled<int> > tree_t;
+    tree_t t1;
+    node_pool* p = t1.get_allocator().pool();
+    BOOST_CHECK(p != NULL);
+    BOOST_CHECK_EQUAL(p->reserved(), 0);
+
+    t1.insert(0);
+    for (int j = 0;  j < 100;  ++j) {
+        t1.root().insert(j);
+        for (int k = 0;  k < 10;  ++k) t1.root().back().insert(k);
+    }
+    BOOST_CHECK_EQUAL(t1.size(), 1101);
+    BOOST_CHECK_EQUAL(t1.depth(), 3);
+    BOOST_CHECK(p->reserved() > 0);
+
+    // int data is trivially destructible, so the pool is dropped all at once
+    t1.clear();
+    BOOST_CHECK(t1.empty());
+    BOOST_CHECK_EQUAL(p->reserved(), 0);
+
+    t1.insert(1);
+    t1.root().insert(2);
+    t1.root().insert(3);
+    CHECK_TREE(t1, data(), "1 2 3");
+    BOOST_CHECK(p->reserved() > 0);
+}
+
+BOOST_AUTO_TEST_CASE(pooled_nontrivial_clear) {
+    typedef tree<string, keyed<string>, pooled<string> > tree_t;
+    tree_t t1;
+    node_pool* p = t1.get_allocator().pool();
+
+    t1.insert("a");
+    t1.root().insert("x", "b");
+    t1.root().insert("y", "c");
+    t1.root()["x"].insert("z", "d");
+    CHECK_TREE(t1, data(), "a b c d");
+    CHECK_TREE(t1, key(), " x y z");
+
+    // string destructors must run, so nodes are released one at a time to the free lists
+    t1.clear();
+    BOOST_CHECK(t1.empty());
+    BOOST_CHECK(p->reserved() > 0);
+
+    t1.insert("e");
+    t1.root().insert("w", "f");
+    CHECK_TREE(t1, data(), "e f");
+}
+
+BOOST_AUTO_TEST_CASE(pooled_free_standing_copy) {
+    typedef tree<int, raw<>, pooled<int> > tree_t;
+    tree_t t1;
+    t1.insert(1);
+    t1.root().insert(2);
+    t1.root().insert(3);
+
+    // n holds pool nodes outside of t1, so clearing t1 must not drop the pool
+    tree_t::node_type n;
+    n = t1.root();
+    t1.clear();
+    BOOST_CHECK(t1.get_allocator().pool()->reserved() > 0);
+    BOOST_CHECK_EQUAL(n.size(), 2);
+    BOOST_CHECK_EQUAL(n[0].data(), 2);
+    BOOST_CHECK_EQUAL(n[1].data(), 3);
+}
+
+BOOST_AUTO_TEST_CASE(pooled_copy_swap_graft) {
+    typedef tree<int, ordered<>, pooled<int> > tree_t;
+    tree_t t1;
+    t1.insert(1);
+    t1.root().insert(2);
+    t1.root().insert(3);
+
+    tree_t t2(t1);
+    BOOST_CHECK(t2 == t1);
+    BOOST_CHECK(t2.get_allocator() != t1.get_allocator());
+
+    tree_t t3;
+    t3.insert(4);
+    node_pool* p1 = t1.get_allocator().pool();
+    node_pool* p3 = t3.get_allocator().pool();
+    t1.swap(t3);
+    BOOST_CHECK_EQUAL(t1.get_allocator().pool(), p3);
+    BOOST_CHECK_EQUAL(t3.get_allocator().pool(), p1);
+    CHECK_TREE(t1, data(), "4");
+    CHECK_TREE(t3, data(), "1 2 3");
+
+    // grafting across pools copies the subtree, and removes the original
+    t1.root().graft(*t3.root().begin());
+    CHECK_TREE(t1, data(), "4 2");
+    CHECK_TREE(t3, data(), "1 3");
+    BOOST_CHECK_EQUAL(t1.size(), 2);
+    BOOST_CHECK_EQUAL(t3.size(), 2);
+
+    t2.graft(t3);
+    CHECK_TREE(t2, data(), "1 3");
+    BOOST_CHECK(t3.empty());
+}
+
+BOOST_AUTO_TEST_CASE(pooled_builder_clear) {
+    typedef tree<int, raw<>, pooled<int> > tree_t;
+    tree_t t1;
+    tree_builder<tree_t> b(t1);
+    for (int r = 0;  r < 3;  ++r) {
+        b.begin_node(r);
+        for (int j = 0;  j < 10;  ++j) {
+            b.begin_node(j);
+            b.begin_node(-j);
+            b.end_node();
+            b.end_node();
+        }
+        b.end_node();
+        BOOST_CHECK_EQUAL(t1.size(), 21);
+        BOOST_CHECK_EQUAL(t1.root().data(), r);
+
+        // the whole pool is released here, which must leave the builder's own state alone
+        t1.clear();
+        BOOST_CHECK(t1.empty());
+    }
+    b.begin_node(7);
+    b.begin_node(8);
+    b.end_node();
+    b.end_node();
+    CHECK_TREE(t1, data(), "7 8");
+}
+
+
+BOOST_AUTO_TEST_SUITE_END() // ut_alloc
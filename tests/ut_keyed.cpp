@@ -97,6 +97,53 @@ BOOST_AUTO_TEST_CASE(emplace_subnodes) {
     BOOST_CHECK_EQUAL(t1.root()["1"].data().s1, "9");
 }
 
+BOOST_AUTO_TEST_CASE(emplace_existing_key) {
+    // counts constructions, to verify that no data is built for a key already present
+    struct str2 {
+        int i1;
+        explicit str2(int i, int* n) : i1(i) { *n += 1; }
+    };
+
+    int n = 0;
+    tree<str2, keyed<std::string> > t1;
+    t1.emplace(7, &n);
+    BOOST_CHECK(t1.root().emplace_insert("0", 8, &n).second);
+    BOOST_CHECK_EQUAL(n, 2);
+
+    pair<tree<str2, keyed<std::string> >::node_type::iterator, bool> r = t1.root().emplace_insert("0", 9, &n);
+    BOOST_CHECK(!r.second);
+    BOOST_CHECK_EQUAL(r.first->data().i1, 8);
+    BOOST_CHECK_EQUAL(n, 2);
+    BOOST_CHECK_EQUAL(t1.size(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(insert_move) {
+    tree<string, keyed<string> > t1;
+    tree<string, keyed<string> > t2;
+    t1.insert("a");
+    t1.root().insert("k", string("b"));
+    t2.insert("c");
+    t2.root().insert("j", "d");
+    t2.root()["j"].insert("i", "e");
+    const tree<string, keyed<string> >::node_type* d = &t2.root()["j"];
+
+    // an existing key refuses the move, and leaves the source intact
+    BOOST_CHECK(!t1.root().insert("k", std::move(t2.root()["j"])).second);
+    CHECK_TREE(t2, data(), "c d e");
+
+    pair<tree<string, keyed<string> >::node_type::iterator, bool> r = t1.root().insert("m", std::move(t2.root()["j"]));
+    BOOST_CHECK(r.second);
+    BOOST_CHECK_EQUAL(&*r.first, d);
+    CHECK_TREE(t1, data(), "a b d e");
+    CHECK_TREE(t1, key(), " k m i");
+    CHECK_TREE(t2, data(), "c");
+
+    t1.root().insert("n", std::move(t2));
+    BOOST_CHECK(t2.empty());
+    CHECK_TREE(t1, data(), "a b d c e");
+    CHECK_TREE(t1, subtree_size(), "5 1 2 1 1");
+}
+
 BOOST_AUTO_TEST_CASE(clear) {
     tree<int, keyed<std::string> > t1;
 
@@ -1154,4 +1201,127 @@ BOOST_AUTO_TEST_CASE(erase_key) {
     CHECK_TREE(t1, data(), "2 3 7");
 }
 
+BOOST_AUTO_TEST_CASE(build_from_parents) {
+    typedef tree<int, keyed<string> > tree_t;
+    tree_t t1;
+    int par[] = {1, -1, 1, 0, 0};
+    pair<string, int> kv[] = {
+        pair<string, int>("x", 1),
+        pair<string, int>("", 0),
+        pair<string, int>("a", 2),
+        pair<string, int>("z", 3),
+        pair<string, int>("y", 4)
+    };
+    t1.build_from_parents(par, par + 5, kv);
+    CHECK_TREE(t1, data(), "0 2 1 4 3");
+    CHECK_TREE(t1, key(), " a x y z");
+    CHECK_TREE(t1, subtree_size(), "5 1 3 1 1");
+    BOOST_CHECK_EQUAL(t1.root()["x"]["z"].data(), 3);
+    BOOST_CHECK_EQUAL(t1.root()["x"]["z"].ply(), 2);
+
+    // sibling keys must be unique
+    kv[3].first = "y";
+    BOOST_CHECK_THROW(t1.build_from_parents(par, par + 5, kv), st_tree::exception);
+    CHECK_TREE(t1, data(), "0 2 1 4 3");
+    t1.root()["x"].erase("z");
+    BOOST_CHECK_EQUAL(t1.size(), 4);
+}
+
+BOOST_AUTO_TEST_CASE(builder_events) {
+    typedef tree<int, keyed<string> > tree_t;
+    tree_t t1;
+    {
+        tree_builder<tree_t> b(t1);
+        b.begin_node(0);
+          b.begin_node("x", 1);
+            b.begin_node("z", 3);  b.end_node();
+            b.begin_node("y", 4);  b.end_node();
+          b.end_node();
+          b.begin_node("a", 2);  b.end_node();
+          // sibling keys must be unique; the rejected node is never opened
+          BOOST_CHECK_THROW(b.begin_node("x", 5), st_tree::exception);
+          BOOST_CHECK_EQUAL(b.open(), 1);
+        b.end_node();
+    }
+    CHECK_TREE(t1, key(), " a x y z");
+    CHECK_TREE(t1, data(), "0 2 1 4 3");
+    CHECK_TREE(t1, subtree_size(), "5 1 3 1 1");
+    BOOST_CHECK_EQUAL(t1.root()["x"]["y"].ply(), 2);
+    t1.root()["x"].erase("y");
+    BOOST_CHECK_EQUAL(t1.size(), 4);
+}
+
+BOOST_AUTO_TEST_CASE(batched_bookkeeping) {
+    typedef tree<int, keyed<int> > tree_t;
+    tree_t t1;
+    t1.insert(0);
+    {
+        tree_t::batch_scope b = t1.begin_batch();
+        for (int j = 0;  j < 20;  ++j) {
+            tree_t::node_type& n = t1.root()[j];
+            for (int k = 0;  k < j;  ++k) n[k][0].data() = k;
+        }
+        t1.root().erase(7);
+        t1.root()[19].erase(3);
+    }
+    BOOST_CHECK_EQUAL(t1.size(), 1 + 19 + 2*(190 - 7) - 2);
+    BOOST_CHECK_EQUAL(t1.depth(), 4);
+    BOOST_CHECK_EQUAL(t1.root()[19].subtree_size(), 1 + 2*18);
+    BOOST_CHECK_EQUAL(t1.root()[0].depth(), 1);
+    BOOST_CHECK_EQUAL(t1.root()[5][4].depth(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(insert_range) {
+    typedef tree<int, keyed<string> > tree_t;
+    tree_t t1;
+    t1.insert(0);
+    t1.root().insert("c", 3);
+    std::vector<pair<string, int> > kv;
+    kv.push_back(pair<string, int>("a", 1));
+    kv.push_back(pair<string, int>("b", 2));
+    kv.push_back(pair<string, int>("b", 20));
+    kv.push_back(pair<string, int>("c", 30));
+    kv.push_back(pair<string, int>("d", 4));
+    // keys already present, including ones earlier in the range, are skipped
+    t1.root().insert(kv.begin(), kv.end());
+    CHECK_TREE(t1, key(), " a b c d");
+    CHECK_TREE(t1, data(), "0 1 2 3 4");
+    BOOST_CHECK_EQUAL(t1.size(), 5);
+    BOOST_CHECK_EQUAL(t1.depth(), 2);
+    BOOST_CHECK_EQUAL(t1.root()["d"].ply(), 1);
+    t1.root()["b"].insert(kv.begin(), kv.begin() + 2);
+    BOOST_CHECK_EQUAL(t1.size(), 7);
+    BOOST_CHECK_EQUAL(t1.depth(), 3);
+    t1.root().erase("b");
+    BOOST_CHECK_EQUAL(t1.size(), 4);
+    BOOST_CHECK_EQUAL(t1.depth(), 2);
+
+    // a (key, data) pair of like types is still a single insert
+    tree<string, keyed<string> > t2;
+    t2.insert("r");
+    t2.root().insert("k", "v");
+    BOOST_CHECK_EQUAL(t2.root()["k"].data(), "v");
+}
+
+BOOST_AUTO_TEST_CASE(erase_if_subtree) {
+    typedef tree<int, keyed<int> > tree_t;
+    tree_t t1;
+    t1.insert(0);
+    for (int j = 0;  j < 10;  ++j) {
+        for (int k = 0;  k < 10;  ++k) t1.root()[j][k].data() = j * k;
+    }
+    size_t m = erase_if(t1.root(), [](const tree_t::node_type& n) { return (n.ply() == 2) && (n.data() >= 20); });
+    BOOST_CHECK_EQUAL(m, size_t(100 - 59));
+    BOOST_CHECK_EQUAL(t1.size(), 1 + 10 + 59);
+    BOOST_CHECK_EQUAL(t1.root()[0].size(), 10);
+    BOOST_CHECK_EQUAL(t1.root()[9].size(), 3);
+    BOOST_CHECK_EQUAL(t1.root()[9].subtree_size(), 4);
+    BOOST_CHECK(t1.root()[9].count(3) == 0);
+
+    erase_if(t1.root(), [](const tree_t::node_type& n) { return (n.ply() == 1) && (n.key() > 2); });
+    CHECK_TREE(t1, key(), "0 0 1 2 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9");
+    BOOST_CHECK_EQUAL(t1.size(), 34);
+    BOOST_CHECK_EQUAL(t1.depth(), 3);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
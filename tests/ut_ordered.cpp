@@ -266,6 +266,33 @@ BOOST_AUTO_TEST_CASE(df_pre_iterator) {
 }
 
 
+BOOST_AUTO_TEST_CASE(df_iterator_subtree) {
+    tree<int, ordered<> > t1;
+    typedef tree<int, ordered<> >::node_type node_type;
+
+    // equal siblings are told apart by position, and a subtree walk stops at its own root
+    t1.insert(0);
+    node_type& n1 = *t1.root().insert(1);
+    t1.root().insert(1);
+    t1.root().insert(1);
+    n1.insert(3);
+    n1.insert(2);
+    n1.insert(3);
+    t1.root().insert(4);
+    CHECK_TREE_DF_PRE(t1, data(), "0 1 2 3 3 1 1 4");
+    CHECK_TREE_DF_POST(t1, data(), "2 3 3 1 1 1 4 0");
+    CHECK_TREE_DF_PRE(n1, data(), "1 2 3 3");
+    CHECK_TREE_DF_POST(n1, data(), "2 3 3 1");
+
+    // post-increment hands back the position before the step
+    node_type::df_pre_iterator j(n1.df_pre_begin());
+    node_type::df_pre_iterator k(j++);
+    BOOST_CHECK_EQUAL(k->data(), 1);
+    BOOST_CHECK_EQUAL(j->data(), 2);
+    BOOST_CHECK_EQUAL((++j)->data(), 3);
+}
+
+
 BOOST_AUTO_TEST_CASE(node_ply) {
     tree<int, ordered<> > t1;
     typedef tree<int, ordered<> >::node_type node_type;
@@ -498,6 +525,33 @@ BOOST_AUTO_TEST_CASE(node_assign_op) {
     CHECK_TREE(t2, subtree_size(), "3 1 1");
 }
 
+BOOST_AUTO_TEST_CASE(node_assign_interior_depth) {
+    typedef tree<int, ordered<> > tree_t;
+    tree_t t1;
+    t1.insert(1);
+    t1.root().insert(2)->insert(3);
+    BOOST_CHECK_EQUAL(t1.depth(), 3);
+
+    // the assigned node is relinked under its parent, whose height must count it again
+    tree_t t2;
+    t2.insert(4);
+    *t1.root().begin() = t2.root();
+    CHECK_TREE(t1, data(), "1 4");
+    CHECK_TREE(t1, depth(), "2 1");
+    CHECK_TREE(t1, subtree_size(), "2 1");
+    BOOST_CHECK_EQUAL(t1.depth(), 2);
+
+    // and grows it again when the new contents are taller
+    tree_t t3;
+    t3.insert(5);
+    t3.root().insert(6)->insert(7);
+    t1.root().insert(0);
+    *t1.root().find(4) = t3.root();
+    CHECK_TREE(t1, data(), "1 0 5 6 7");
+    CHECK_TREE(t1, depth(), "4 1 3 2 1");
+    BOOST_CHECK_EQUAL(t1.size(), 5);
+}
+
 
 BOOST_AUTO_TEST_CASE(node_op_equal_root) {
     tree<int, ordered<> > t1;
@@ -896,6 +950,28 @@ BOOST_AUTO_TEST_CASE(insert_node) {
     CHECK_TREE(t2, subtree_size(), "2 1");
 }
 
+BOOST_AUTO_TEST_CASE(insert_move) {
+    tree<int, ordered<> > t1;
+    tree<int, ordered<> > t2;
+    t1.insert(2);
+    t1.root().insert(7);
+    t2.insert(1);
+    t2.root().insert(5);
+    t2.root().begin()->insert(3);
+    const tree<int, ordered<> >::node_type* n5 = &*t2.root().begin();
+
+    tree<int, ordered<> >::node_type::iterator j = t1.root().insert(std::move(*t2.root().begin()));
+    BOOST_CHECK_EQUAL(&*j, n5);
+    CHECK_TREE(t1, data(), "2 5 7 3");
+    CHECK_TREE(t1, depth(), "3 2 1 1");
+    CHECK_TREE(t2, data(), "1");
+
+    t1.root().insert(std::move(t2));
+    BOOST_CHECK(t2.empty());
+    CHECK_TREE(t1, data(), "2 1 5 7 3");
+    CHECK_TREE(t1, subtree_size(), "5 1 2 1 1");
+}
+
 
 BOOST_AUTO_TEST_CASE(node_op_equality) {
     tree<int, ordered<> > t1;
@@ -1253,4 +1329,59 @@ BOOST_AUTO_TEST_CASE(erase_key) {
     CHECK_TREE(t1, data(), "2 3 7");
 }
 
+BOOST_AUTO_TEST_CASE(build_from_parents) {
+    tree<int, ordered<> > t1;
+    int par[] = {-1, 0, 0, 0, 2, 2, 1};
+    int dat[] = {0, 9, 4, 9, 8, 1, 3};
+    t1.build_from_parents(par, par + 7, dat);
+    CHECK_TREE(t1, data(), "0 4 9 9 1 8 3");
+    CHECK_TREE(t1, subtree_size(), "7 3 2 1 1 1 1");
+    BOOST_CHECK_EQUAL(t1.depth(), 3);
+    BOOST_CHECK_EQUAL(t1.root().count(9), unsigned(2));
+
+    // ordered children keep working as usual
+    t1.root().insert(5);
+    CHECK_TREE(t1, data(), "0 4 5 9 9 1 8 3");
+    t1.root().erase(9);
+    CHECK_TREE(t1, data(), "0 4 5 1 8");
+    BOOST_CHECK_EQUAL(t1.size(), 5);
+}
+
+BOOST_AUTO_TEST_CASE(insert_range) {
+    tree<int, ordered<> > t1;
+    t1.insert(0);
+    t1.root().insert(2);
+    int v[] = {3, 3, 5, 8};
+    t1.root().insert(v, v + 4);
+    CHECK_TREE(t1, data(), "0 2 3 3 5 8");
+    BOOST_CHECK_EQUAL(t1.size(), 6);
+
+    // unsorted ranges still land in order
+    int w[] = {9, 1, 4, 3};
+    t1.root().insert(w, w + 4);
+    CHECK_TREE(t1, data(), "0 1 2 3 3 3 4 5 8 9");
+    BOOST_CHECK_EQUAL(t1.root().count(3), unsigned(3));
+    t1.root().find(2)->insert(w, w + 2);
+    BOOST_CHECK_EQUAL(t1.size(), 12);
+    BOOST_CHECK_EQUAL(t1.depth(), 3);
+    t1.root().erase(2);
+    BOOST_CHECK_EQUAL(t1.size(), 9);
+    BOOST_CHECK_EQUAL(t1.depth(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(erase_if_subtree) {
+    typedef tree<int, ordered<> > tree_t;
+    tree_t t1;
+    t1.insert(0);
+    for (int j = 1;  j <= 5;  ++j) {
+        tree_t::node_type::iterator c = t1.root().insert(j);
+        for (int k = 1;  k <= 2;  ++k) c->insert(10*j + k);
+    }
+    size_t m = erase_if(t1.root(), [](const tree_t::node_type& n) { return (n.data() % 2) == 1; });
+    BOOST_CHECK_EQUAL(m, 3 + 2);
+    CHECK_TREE(t1, data(), "0 2 4 22 42");
+    CHECK_TREE(t1, subtree_size(), "5 2 2 1 1");
+    CHECK_TREE(t1, depth(), "3 2 2 1 1");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,364 @@
+#include <boost/test/unit_test.hpp>
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+
+#include "st_tree_parallel.h"
+#include "ut_common.h"
+
+
+BOOST_AUTO_TEST_SUITE(ut_parallel)
+
+
+// builds a tree of n nodes, giving each node up to 'fanout' children, level by level
+template <typename Tree>
+void build_wide(Tree& t, int n, int fanout) {
+    t.insert(0);
+    int count = 1;
+    for (typename Tree::bf_iterator j(t.bf_begin());  (j != t.bf_end()) && (count < n);  ++j) {
+        for (int k = 0;  (k < fanout) && (count < n);  ++k, ++count) j->insert(count);
+    }
+}
+
+// a stateful allocator that notes whether it was ever used off its owner's thread
+template <typename T>
+struct owned_allocator {
+    typedef T value_type;
+
+    static std::atomic<bool>& default_strayed() {
+        static std::atomic<bool> s(false);
+        return s;
+    }
+
+    owned_allocator() : _strayed(&default_strayed()), _owner(std::this_thread::get_id()) {}
+    explicit owned_allocator(std::atomic<bool>* strayed) : _strayed(strayed), _owner(std::this_thread::get_id()) {}
+    template <typename U>
+    owned_allocator(const owned_allocator<U>& src) : _strayed(src._strayed), _owner(src._owner) {}
+
+    T* allocate(size_t n) {
+        if (std::this_thread::get_id() != _owner) _strayed->store(true);
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t) { ::operator delete(p); }
+
+    template <typename U>
+    bool operator==(const owned_allocator<U>& rhs) const { return _strayed == rhs._strayed; }
+    template <typename U>
+    bool operator!=(const owned_allocator<U>& rhs) const { return _strayed != rhs._strayed; }
+
+    std::atomic<bool>* _strayed;
+    std::thread::id _owner;
+};
+
+template <typename Node>
+struct increment {
+    void operator()(Node& n) const { n.data() += 1; }
+};
+
+template <typename Tree>
+long data_sum(const Tree& t) {
+    long s = 0;
+    for (typename Tree::const_df_pre_iterator j(t.df_pre_begin());  j != t.df_pre_end();  ++j) s += j->data();
+    return s;
+}
+
+
+BOOST_AUTO_TEST_CASE(for_each_visits_once) {
+    typedef tree<int> tree_t;
+    tree_t t1;
+    build_wide(t1, 50000, 3);
+    long s = data_sum(t1);
+
+    // every node is applied exactly once, across grains that split the tree finely and not at all
+    parallel_for_each(t1, increment<tree_t::node_type>(), parallel_policy(4, 16));
+    BOOST_CHECK_EQUAL(data_sum(t1), s + 50000);
+    parallel_for_each(t1, increment<tree_t::node_type>(), parallel_policy(4, 1));
+    BOOST_CHECK_EQUAL(data_sum(t1), s + 2*50000);
+    parallel_for_each(t1, increment<tree_t::node_type>(), parallel_policy(4, 100000));
+    BOOST_CHECK_EQUAL(data_sum(t1), s + 3*50000);
+    parallel_for_each(t1.root()[1], increment<tree_t::node_type>(), parallel_policy(3, 8));
+    BOOST_CHECK_EQUAL(data_sum(t1), s + 3*50000 + long(t1.root()[1].subtree_size()));
+
+    // a lopsided tree: one long chain next to a wide fan
+    tree_t t2;
+    t2.insert(0);
+    tree_t::node_type* p = &*t2.root().insert(0);
+    for (int j = 0;  j < 5000;  ++j) p = &*p->insert(0);
+    for (int j = 0;  j < 5000;  ++j) t2.root().insert(0);
+    std::atomic<long> c(0);
+    parallel_for_each(static_cast<const tree_t&>(t2), [&c](const tree_t::node_type&) { c.fetch_add(1); }, parallel_policy(4, 32));
+    BOOST_CHECK_EQUAL(c.load(), long(t2.size()));
+}
+
+BOOST_AUTO_TEST_CASE(for_each_models) {
+    typedef tree<int, raw<>, std::allocator<int>, tracking<false, false> > untracked_t;
+    untracked_t t1;
+    build_wide(t1, 20000, 4);
+    long s = data_sum(t1);
+    parallel_for_each(t1, increment<untracked_t::node_type>(), parallel_policy(4, 64));
+    BOOST_CHECK_EQUAL(data_sum(t1), s + 20000);
+
+    typedef tree<int, keyed<int> > keyed_t;
+    keyed_t t2;
+    t2.insert(0);
+    for (int j = 0;  j < 100;  ++j) {
+        keyed_t::node_type& q = t2.root()[j];
+        for (int k = 0;  k < 100;  ++k) q[k].data() = k;
+    }
+    std::atomic<long> c(0);
+    parallel_for_each(t2, [&c](keyed_t::node_type& n) { c.fetch_add(n.data()); }, parallel_policy(4, 50));
+    BOOST_CHECK_EQUAL(c.load(), 100 * 4950);
+
+    tree<int> t3;
+    parallel_for_each(t3, increment<tree<int>::node_type>(), parallel_policy(4, 1));
+    BOOST_CHECK(t3.empty());
+}
+
+BOOST_AUTO_TEST_CASE(for_each_exception) {
+    tree<int> t1;
+    build_wide(t1, 10000, 4);
+    BOOST_CHECK_THROW(parallel_for_each(t1, [](tree<int>::node_type& n) { if (n.data() == 7777) throw std::runtime_error("x"); }, parallel_policy(4, 16)), std::runtime_error);
+}
+
+
+// sums the subtree, weighting each node's data by the number of nodes below it
+struct weighted_leaf {
+    template <typename Node> pair<long, long> operator()(const Node& n) const { return pair<long, long>(n.data(), 1); }
+};
+struct weighted_combine {
+    template <typename Node>
+    pair<long, long> operator()(const Node& n, pair<long, long>* first, pair<long, long>* last) const {
+        pair<long, long> r(0, 1);
+        for (;  first != last;  ++first) {
+            r.first += first->first;
+            r.second += first->second;
+        }
+        r.first += n.data() * (r.second - 1);
+        return r;
+    }
+};
+
+template <typename Tree>
+long weighted_serial(const Tree& t) {
+    long s = 0;
+    for (typename Tree::const_df_pre_iterator j(t.df_pre_begin());  j != t.df_pre_end();  ++j)
+        s += j->data() * long(j->empty() ? 1 : j->subtree_size() - 1);
+    return s;
+}
+
+BOOST_AUTO_TEST_CASE(fold_bottom_up) {
+    typedef tree<int> tree_t;
+    tree_t t1;
+    build_wide(t1, 50000, 5);
+    long w = weighted_serial(t1);
+
+    // the same value comes back however the work is split
+    BOOST_CHECK_EQUAL(parallel_fold(t1, weighted_leaf(), weighted_combine(), parallel_policy(4, 16)).first, w);
+    BOOST_CHECK_EQUAL(parallel_fold(t1, weighted_leaf(), weighted_combine(), parallel_policy(4, 1)).first, w);
+    BOOST_CHECK_EQUAL(parallel_fold(t1, weighted_leaf(), weighted_combine(), parallel_policy(1, 16)).first, w);
+    BOOST_CHECK_EQUAL(parallel_fold(static_cast<const tree_t&>(t1), weighted_leaf(), weighted_combine(), parallel_policy(3, 100)).second, 50000);
+    BOOST_CHECK_EQUAL(parallel_fold(t1.root()[2], weighted_leaf(), weighted_combine(), parallel_policy(4, 8)).second, long(t1.root()[2].subtree_size()));
+
+    // children arrive in child order: evaluate an expression tree
+    tree<string> e;
+    e.insert("-");
+    e.root().insert("*");
+    e.root().insert("4");
+    e.root()[0].insert("3");
+    e.root()[0].insert("5");
+    auto leaf = [](const tree<string>::node_type& n) { return std::stol(n.data()); };
+    auto combine = [](const tree<string>::node_type& n, long* first, long* last) {
+        long r = *first;
+        for (++first;  first != last;  ++first) r = (n.data() == "-") ? r - *first : r * *first;
+        return r;
+    };
+    BOOST_CHECK_EQUAL(parallel_fold(e, leaf, combine, parallel_policy(2, 1)), 11);
+
+    // results of type bool are held contiguously too
+    typedef tree<int, raw<>, std::allocator<int>, tracking<false, false> > untracked_t;
+    untracked_t t2;
+    build_wide(t2, 5000, 3);
+    bool any = parallel_fold(t2, [](const untracked_t::node_type& n) { return n.data() == 4321; },
+                             [](const untracked_t::node_type& n, bool* first, bool* last) {
+                                 bool r = (n.data() == 4321);
+                                 for (;  first != last;  ++first) r = r || *first;
+                                 return r;
+                             }, parallel_policy(4, 8));
+    BOOST_CHECK(any);
+
+    BOOST_CHECK_THROW(parallel_fold(t1, [](const tree_t::node_type& n) -> long { if (n.data() == 40000) throw std::runtime_error("x"); return 0; },
+                                    [](const tree_t::node_type&, long*, long*) { return 0L; }, parallel_policy(4, 16)), std::runtime_error);
+}
+
+// throws on the nth copy, counting across threads
+struct fragile {
+    static std::atomic<int> copies;
+    static int fail_at;
+    int v;
+    fragile(int v_ = 0) : v(v_) {}
+    fragile(const fragile& src) : v(src.v) {
+        if (copies.fetch_add(1) + 1 == fail_at) throw std::runtime_error("copy");
+    }
+    fragile& operator=(const fragile& src) { v = src.v;  return *this; }
+    bool operator==(const fragile& rhs) const { return v == rhs.v; }
+    bool operator!=(const fragile& rhs) const { return v != rhs.v; }
+    bool operator<(const fragile& rhs) const { return v < rhs.v; }
+};
+std::atomic<int> fragile::copies(0);
+int fragile::fail_at = 0;
+
+template <typename Tree>
+bool same_shape(const Tree& t1, const Tree& t2) {
+    typename Tree::const_df_pre_iterator j1(t1.df_pre_begin());
+    typename Tree::const_df_pre_iterator j2(t2.df_pre_begin());
+    for (;  j1 != t1.df_pre_end();  ++j1, ++j2) {
+        if (j2 == t2.df_pre_end()) return false;
+        if ((j1->ply() != j2->ply()) || (j1->size() != j2->size()) || (&j2->tree() != &t2)) return false;
+        if (!j2->is_root() && (&j2->parent().tree() != &t2)) return false;
+    }
+    return j2 == t2.df_pre_end();
+}
+
+BOOST_AUTO_TEST_CASE(copy_from_parallel) {
+    typedef tree<int> tree_t;
+    tree_t t1;
+    build_wide(t1, 50000, 4);
+    tree_t t2;
+    t2.insert(-1);
+    t2.root().insert(-2);
+    t2.copy_from(t1, parallel_policy(4, 16));
+    BOOST_CHECK(t2 == t1);
+    BOOST_CHECK_EQUAL(t2.size(), 50000);
+    BOOST_CHECK_EQUAL(t2.depth(), t1.depth());
+    BOOST_CHECK(same_shape(t1, t2));
+    for (int j = 0;  j < 4;  ++j) BOOST_CHECK_EQUAL(t2.root()[j].index_in_parent(), size_t(j));
+
+    // the copy is an ordinary tree: it grows and shrinks independently of its source
+    tree_t::node_type& q = t2.root()[3][1];
+    size_t s = q.subtree_size();
+    q.insert(7);
+    BOOST_CHECK_EQUAL(t2.size(), 50001);
+    BOOST_CHECK_EQUAL(t1.size(), 50000);
+    t2.root().erase(t2.root().begin() + 3);
+    BOOST_CHECK_EQUAL(t2.size(), 50000 - t1.root()[3].subtree_size());
+    BOOST_CHECK_EQUAL(t1.root()[3][1].subtree_size(), s);
+
+    // coarse grains, a single thread, and an empty source
+    t2.copy_from(t1, parallel_policy(4, 1000000));
+    BOOST_CHECK(t2 == t1);
+    t2.copy_from(t1, parallel_policy(1, 16));
+    BOOST_CHECK(t2 == t1);
+    t2.copy_from(tree_t(), parallel_policy(4, 16));
+    BOOST_CHECK(t2.empty());
+
+    typedef tree<int, ordered<> > ordered_t;
+    ordered_t t3;
+    build_wide(t3, 20000, 6);
+    ordered_t t4;
+    t4.copy_from(t3, parallel_policy(4, 32));
+    BOOST_CHECK(t4 == t3);
+    BOOST_CHECK(same_shape(t3, t4));
+    t4.root().erase(t4.root().begin());
+    BOOST_CHECK_EQUAL(t4.size(), t3.size() - t3.root().begin()->subtree_size());
+
+    typedef tree<int, keyed<int> > keyed_t;
+    keyed_t t5;
+    t5.insert(0);
+    for (int j = 0;  j < 200;  ++j) {
+        keyed_t::node_type& n = t5.root()[j];
+        for (int k = 0;  k < 50;  ++k) n[k].data() = j * k;
+    }
+    keyed_t t6;
+    t6.copy_from(t5, parallel_policy(4, 20));
+    BOOST_CHECK(t6 == t5);
+    BOOST_CHECK(same_shape(t5, t6));
+    BOOST_CHECK_EQUAL(t6.root()[17][3].data(), 51);
+    BOOST_CHECK(t6.root().count(199) == 1);
+
+    typedef tree<int, raw<>, std::allocator<int>, tracking<false, false> > untracked_t;
+    untracked_t t7;
+    build_wide(t7, 20000, 3);
+    untracked_t t8;
+    t8.copy_from(t7, parallel_policy(4, 8));
+    BOOST_CHECK(t8 == t7);
+    BOOST_CHECK(same_shape(t7, t8));
+
+    // a pooled tree's node pool is not shared between threads, so it is copied serially
+    typedef tree<int, raw<>, pooled<int> > pooled_t;
+    pooled_t t9;
+    build_wide(t9, 10000, 3);
+    pooled_t t10;
+    t10.copy_from(t9, parallel_policy(4, 8));
+    BOOST_CHECK(t10 == t9);
+    BOOST_CHECK(same_shape(t9, t10));
+
+    // so is a tree with any other stateful allocator
+    typedef tree<int, raw<>, owned_allocator<int> > owned_t;
+    std::atomic<bool> strayed(false);
+    owned_t t11((owned_allocator<int>(&strayed)));
+    build_wide(t11, 10000, 3);
+    owned_t t12((owned_allocator<int>(&strayed)));
+    t12.copy_from(t11, parallel_policy(4, 8));
+    BOOST_CHECK(t12 == t11);
+    BOOST_CHECK(same_shape(t11, t12));
+    BOOST_CHECK(!strayed.load());
+}
+
+BOOST_AUTO_TEST_CASE(copy_from_exception) {
+    typedef tree<fragile> tree_t;
+    tree_t t1;
+    build_wide(t1, 20000, 4);
+    tree_t t2;
+    t2.insert(fragile(-1));
+    t2.root().insert(fragile(-2));
+
+    // the partial copy is released, and the target is left as it was
+    fragile::copies.store(0);
+    fragile::fail_at = 15000;
+    BOOST_CHECK_THROW(t2.copy_from(t1, parallel_policy(4, 16)), std::runtime_error);
+    BOOST_CHECK_EQUAL(t2.size(), 2);
+    BOOST_CHECK_EQUAL(t2.root()[0].data().v, -2);
+
+    fragile::fail_at = 0;
+    t2.copy_from(t1, parallel_policy(4, 16));
+    BOOST_CHECK(t2 == t1);
+}
+
+BOOST_AUTO_TEST_CASE(background_reclamation) {
+    typedef tree<string> tree_t;
+    tree_t t1;
+    t1.insert("r");
+    for (int j = 0;  j < 100;  ++j) {
+        tree_t::node_type& n = *t1.root().insert("n");
+        for (int k = 0;  k < 100;  ++k) n.insert("leaf");
+    }
+    {
+        background_reclaimer<tree_t> r(t1, std::chrono::milliseconds(1));
+        BOOST_CHECK(t1.deferring_reclamation());
+
+        // the tree carries on changing while erased subtrees are released behind it
+        for (int j = 0;  j < 50;  ++j) {
+            t1.root().erase(t1.root().begin());
+            t1.root().insert("m")->insert("leaf");
+            if (j % 10 == 0) r.wake();
+        }
+        BOOST_CHECK_EQUAL(t1.size(), 1 + 50*101 + 50*2);
+        r.flush();
+        BOOST_CHECK_EQUAL(t1.size(), 1 + 50*101 + 50*2);
+        t1.clear();
+        t1.insert("s");
+        t1.root().insert("t");
+    }
+    BOOST_CHECK(!t1.deferring_reclamation());
+    BOOST_CHECK_EQUAL(t1.size(), 2);
+
+    // trees whose allocators may not serve two threads at once cannot have a reclaimer
+    typedef tree<int, raw<>, owned_allocator<int> > owned_t;
+    typedef tree<int, raw<>, pooled<int> > pooled_t;
+    BOOST_CHECK(st_tree::detail::pool_dispatch<tree_t::node_allocator_type>::concurrent);
+    BOOST_CHECK(!st_tree::detail::pool_dispatch<owned_t::node_allocator_type>::concurrent);
+    BOOST_CHECK(!st_tree::detail::pool_dispatch<pooled_t::node_allocator_type>::concurrent);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
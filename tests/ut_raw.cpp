@@ -4,6 +4,14 @@
 #include "ut_common.h"
 
 #include <algorithm>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+// depth of the chain-shaped trees in deep_chain: define as 10000000 for a full stress run
+#if !defined(UT_DEEP_CHAIN)
+#define UT_DEEP_CHAIN 1000000
+#endif
 
 
 BOOST_AUTO_TEST_SUITE(ut_raw)
@@ -97,6 +105,27 @@ BOOST_AUTO_TEST_CASE(emplace_subnodes) {
     BOOST_CHECK_EQUAL(t1.root()[1].data().s1, "9");
 }
 
+BOOST_AUTO_TEST_CASE(emplace_in_place) {
+    // neither default-constructible nor assignable: only constructed in place
+    struct str2 {
+        const int i1;
+        explicit str2(int i) : i1(i) {}
+        str2& operator=(const str2&) = delete;
+    };
+
+    tree<str2> t1;
+    t1.emplace(7);
+    t1.root().emplace_back(8);
+    t1.root().emplace_insert(9);
+    t1.root()[0].emplace_back(10);
+    BOOST_CHECK_EQUAL(t1.size(), 4);
+    BOOST_CHECK_EQUAL(t1.depth(), 3);
+    BOOST_CHECK_EQUAL(t1.root().data().i1, 7);
+    BOOST_CHECK_EQUAL(t1.root()[0].data().i1, 8);
+    BOOST_CHECK_EQUAL(t1.root()[1].data().i1, 9);
+    BOOST_CHECK_EQUAL(t1.root()[0][0].data().i1, 10);
+}
+
 
 BOOST_AUTO_TEST_CASE(clear) {
     tree<int> t1;
@@ -267,6 +296,102 @@ BOOST_AUTO_TEST_CASE(df_pre_iterator) {
 
 
 
+BOOST_AUTO_TEST_CASE(skip_children) {
+    tree<int> t1;
+    t1.insert(2);
+    t1.root().insert(3);
+    t1.root().insert(5);
+    t1.root()[0].insert(7);
+    t1.root()[0].insert(11);
+    t1.root()[1].insert(13);
+    t1.root()[1][0].insert(17);
+    t1.root().insert(19);
+    t1.root()[2].insert(23);
+
+    // subtrees rooted at odd multiples of 5 are rejected at their root
+    std::stringstream pre;
+    for (tree<int>::df_pre_iterator j(t1.df_pre_begin());  j != t1.df_pre_end();  ++j) {
+        pre << j->data() << " ";
+        if (j->data() == 5) j.skip_children();
+    }
+    BOOST_CHECK_EQUAL(pre.str(), "2 3 7 11 5 19 23 ");
+
+    std::stringstream bf;
+    for (tree<int>::bf_iterator j(t1.bf_begin());  j != t1.bf_end();  ++j) {
+        bf << j->data() << " ";
+        if (j->data() == 5) j.skip_children();
+    }
+    BOOST_CHECK_EQUAL(bf.str(), "2 3 5 19 7 11 23 ");
+
+    // skipping at the start of a subtree walk ends it, and skipping a leaf changes nothing
+    tree<int>::node_type::df_pre_iterator k(t1.root()[1].df_pre_begin());
+    k.skip_children();
+    ++k;
+    BOOST_CHECK(k == t1.root()[1].df_pre_end());
+    std::stringstream leaf;
+    for (tree<int>::df_pre_iterator j(t1.df_pre_begin());  j != t1.df_pre_end();  ++j) {
+        leaf << j->data() << " ";
+        if (j->empty()) j.skip_children();
+    }
+    BOOST_CHECK_EQUAL(leaf.str(), "2 3 7 11 5 13 17 19 23 ");
+}
+
+
+struct trace_visitor {
+    std::stringstream s;
+    int skip;
+    trace_visitor(int skip_ = -1) : s(), skip(skip_) {}
+    bool enter(const tree<int>::node_type& n, size_t ply) {
+        s << "+" << n.data() << ":" << ply << " ";
+        return n.data() != skip;
+    }
+    void exit(const tree<int>::node_type& n, size_t) { s << "-" << n.data() << " "; }
+};
+
+struct sum_visitor {
+    int sum;
+    sum_visitor() : sum(0) {}
+    void enter(tree<int>::node_type& n, size_t) { n.data() += 1; }
+    void exit(tree<int>::node_type& n, size_t) { sum += n.data(); }
+};
+
+BOOST_AUTO_TEST_CASE(visit_enter_exit) {
+    tree<int> t1;
+    trace_visitor v0;
+    visit(t1, v0);
+    BOOST_CHECK_EQUAL(v0.s.str(), "");
+
+    t1.insert(2);
+    t1.root().insert(3);
+    t1.root().insert(5);
+    t1.root()[0].insert(7);
+    t1.root()[1].insert(11);
+    t1.root()[1][0].insert(13);
+
+    const tree<int>& ct1 = t1;
+    trace_visitor v1;
+    visit(ct1, v1);
+    BOOST_CHECK_EQUAL(v1.s.str(), "+2:0 +3:1 +7:2 -7 -3 +5:1 +11:2 +13:3 -13 -11 -5 -2 ");
+
+    // rejecting a node at enter() skips its children, but it is still exited
+    trace_visitor v2(5);
+    visit(ct1, v2);
+    BOOST_CHECK_EQUAL(v2.s.str(), "+2:0 +3:1 +7:2 -7 -3 +5:1 -5 -2 ");
+
+    // plies count from where the walk starts, which is also where it ends
+    trace_visitor v3;
+    visit(ct1.root()[1], v3);
+    BOOST_CHECK_EQUAL(v3.s.str(), "+5:0 +11:1 +13:2 -13 -11 -5 ");
+
+    // a visitor passed as a temporary can modify the nodes
+    visit(t1, sum_visitor());
+    CHECK_TREE(t1, data(), "3 4 6 8 12 14");
+    sum_visitor v4;
+    visit(t1.root(), v4);
+    BOOST_CHECK_EQUAL(v4.sum, 4+5+7+9+13+15);
+}
+
+
 BOOST_AUTO_TEST_CASE(node_ply) {
     tree<int> t1;
 
@@ -343,6 +468,36 @@ BOOST_AUTO_TEST_CASE(node_depth) {
     CHECK_TREE(t1, depth(), "1");
 }
 
+BOOST_AUTO_TEST_CASE(node_depth_tallest_branch) {
+    tree<int> t1;
+
+    t1.insert(2);
+    t1.root().insert(3);
+    t1.root().insert(5);
+    t1.root().insert(7);
+    t1.root()[1].insert(11);
+    t1.root()[1][0].insert(13);
+    t1.root()[2].insert(17);
+    CHECK_TREE(t1, data(), "2 3 5 7 11 17 13");
+    CHECK_TREE(t1, depth(), "4 1 3 2 2 1 1");
+
+    // swapping the tallest branch down a level deepens the tree
+    t1.root()[1].swap(t1.root()[2][0]);
+    CHECK_TREE(t1, data(), "2 3 17 7 5 11 13");
+    CHECK_TREE(t1, depth(), "5 1 1 4 3 2 1");
+
+    // a range erase that takes out the tallest branch along with a shorter one
+    t1.root().erase(t1.root().begin()+1, t1.root().end());
+    CHECK_TREE(t1, data(), "2 3");
+    CHECK_TREE(t1, depth(), "2 1");
+
+    t1.root().insert(19);
+    t1.root()[1].insert(23);
+    t1.root()[1][0].erase();
+    CHECK_TREE(t1, data(), "2 3 19");
+    CHECK_TREE(t1, depth(), "2 1 1");
+}
+
 BOOST_AUTO_TEST_CASE(node_subtree_size) {
     tree<int> t1;
 
@@ -629,6 +784,34 @@ BOOST_AUTO_TEST_CASE(node_swap) {
     BOOST_CHECK_THROW(swap(t1.root()[1], t1.root()), st_tree::exception);
 }
 
+BOOST_AUTO_TEST_CASE(sibling_swap_depth) {
+    // 0(1(4) 2(3(5) 6)): the taller sibling moves, and the root's depth must not lose it
+    tree<int> t1;
+    t1.insert(0);
+    t1.root().insert(1)->insert(4);
+    t1.root().insert(2);
+    t1.root()[1].insert(3)->insert(5);
+    t1.root()[1].insert(6);
+    BOOST_CHECK_EQUAL(t1.depth(), 4);
+
+    swap(t1.root()[1][0], t1.root()[1][1]);
+    CHECK_TREE(t1, data(), "0 1 2 4 6 3 5");
+    CHECK_TREE(t1, depth(), "4 2 3 1 1 2 1");
+    CHECK_TREE(t1, subtree_size(), "7 2 4 1 1 2 1");
+    BOOST_CHECK_EQUAL(t1.depth(), 4);
+    BOOST_CHECK_EQUAL(t1.root()[1][1].index_in_parent(), 1);
+
+    // cousins, the shorter one first
+    swap(t1.root()[0][0], t1.root()[1][1]);
+    CHECK_TREE(t1, data(), "0 1 2 3 6 4 5");
+    CHECK_TREE(t1, depth(), "4 3 2 2 1 1 1");
+    CHECK_TREE(t1, subtree_size(), "7 3 3 2 1 1 1");
+
+    swap(t1.root()[1][1], t1.root()[0][0]);
+    CHECK_TREE(t1, data(), "0 1 2 4 6 3 5");
+    CHECK_TREE(t1, depth(), "4 2 3 1 1 2 1");
+}
+
 
 BOOST_AUTO_TEST_CASE(graft) {
     tree<int> t1;
@@ -1050,6 +1233,65 @@ BOOST_AUTO_TEST_CASE(tree_swap) {
     CHECK_TREE(t2, data(), "3");
 }
 
+BOOST_AUTO_TEST_CASE(tree_move) {
+    tree<string> t1;
+    t1.insert("a");
+    t1.root().insert("b");
+    t1.root()[0].insert("c");
+    const tree<string>::node_type* r = &t1.root();
+
+    // move construction takes over the nodes, and leaves the source empty
+    tree<string> t2(std::move(t1));
+    BOOST_CHECK(t1.empty());
+    BOOST_CHECK_EQUAL(&t2.root(), r);
+    BOOST_CHECK_EQUAL(&t2.root().tree(), &t2);
+    CHECK_TREE(t2, data(), "a b c");
+
+    tree<string> t3;
+    t3.insert("x");
+    t3 = std::move(t2);
+    BOOST_CHECK(t2.empty());
+    BOOST_CHECK_EQUAL(&t3.root(), r);
+    BOOST_CHECK_EQUAL(&t3.root()[0][0].tree(), &t3);
+    CHECK_TREE(t3, data(), "a b c");
+    CHECK_TREE(t3, subtree_size(), "3 2 1");
+}
+
+BOOST_AUTO_TEST_CASE(insert_move) {
+    tree<string> t1;
+    string s("payload");
+    t1.insert(std::move(s));
+    t1.root().push_back(string("b"));
+    t1.root().insert(string("c"));
+    CHECK_TREE(t1, data(), "payload b c");
+
+    tree<string> t2;
+    t2.insert("x");
+    t2.root().insert("y");
+    t2.root()[0].insert("z");
+    const tree<string>::node_type* y = &t2.root()[0];
+
+    // moving a subtree relinks its nodes, rather than copying them
+    tree<string>::node_type::iterator j = t1.root().insert(std::move(t2.root()[0]));
+    BOOST_CHECK_EQUAL(&*j, y);
+    CHECK_TREE(t1, data(), "payload b c y z");
+    CHECK_TREE(t1, depth(), "3 1 1 2 1");
+    CHECK_TREE(t2, data(), "x");
+    CHECK_TREE(t2, depth(), "1");
+
+    t1.root()[0].push_back(std::move(t2));
+    BOOST_CHECK(t2.empty());
+    CHECK_TREE(t1, data(), "payload b c y x z");
+    CHECK_TREE(t1, subtree_size(), "6 2 1 2 1 1");
+
+    // free-standing nodes are not owned by a tree, so they are copied
+    tree<string>::node_type n;
+    n = t1.root()[2];
+    t1.root().insert(std::move(n));
+    CHECK_TREE(t1, data(), "payload b c y y x z z");
+    BOOST_CHECK_EQUAL(n.size(), 1);
+}
+
 BOOST_AUTO_TEST_CASE(push_pop_back) {
     tree<int> t1;
     t1.insert(2);
@@ -1135,4 +1377,740 @@ BOOST_AUTO_TEST_CASE(sort_children) {
     CHECK_TREE(t1, data(), "2 3 5 7 11 13");
 }
 
+BOOST_AUTO_TEST_CASE(untracked_bookkeeping) {
+    typedef tree<int, raw<>, std::allocator<int>, tracking<false, false> > tree_t;
+    BOOST_CHECK(sizeof(tree_t::node_type) < sizeof(tree<int>::node_type));
+
+    tree_t t1;
+    t1.insert(2);
+    t1.root().insert(3);
+    t1.root().insert(5);
+    t1.root()[0].insert(7);
+    t1.root()[0][0].insert(11);
+    CHECK_TREE(t1, data(), "2 3 5 7 11");
+    CHECK_TREE(t1, depth(), "4 3 1 2 1");
+    CHECK_TREE(t1, subtree_size(), "5 3 1 2 1");
+    BOOST_CHECK_EQUAL(t1.size(), 5);
+    BOOST_CHECK_EQUAL(t1.depth(), 4);
+
+    t1.root().erase(t1.root().begin());
+    CHECK_TREE(t1, data(), "2 5");
+    CHECK_TREE(t1, depth(), "2 1");
+    BOOST_CHECK_EQUAL(t1.size(), 2);
+
+    tree_t t2(t1);
+    BOOST_CHECK(t2 == t1);
+}
+
+BOOST_AUTO_TEST_CASE(size_only_bookkeeping) {
+    typedef tree<int, raw<>, std::allocator<int>, tracking<true, false> > tree_t;
+    tree_t t1;
+    t1.insert(2);
+    t1.root().insert(3);
+    t1.root().insert(5);
+    t1.root()[1].insert(7);
+    CHECK_TREE(t1, depth(), "3 1 2 1");
+    CHECK_TREE(t1, subtree_size(), "4 1 2 1");
+
+    t1.root()[1].erase(t1.root()[1].begin());
+    CHECK_TREE(t1, depth(), "2 1 1");
+    CHECK_TREE(t1, subtree_size(), "3 1 1");
+}
+
+BOOST_AUTO_TEST_CASE(index_in_parent) {
+    tree<int> t1;
+    t1.insert(0);
+    BOOST_CHECK_THROW(t1.root().index_in_parent(), st_tree::parent_exception);
+    for (int j = 1;  j <= 6;  ++j) t1.root().insert(j);
+    for (size_t j = 0;  j < 6;  ++j) BOOST_CHECK_EQUAL(t1.root()[j].index_in_parent(), j);
+
+    // erasing renumbers the following siblings
+    t1.root().erase(t1.root().begin()+1);
+    CHECK_TREE(t1, data(), "0 1 3 4 5 6");
+    for (size_t j = 0;  j < 5;  ++j) BOOST_CHECK_EQUAL(t1.root()[j].index_in_parent(), j);
+    t1.root()[3].erase();
+    t1.root().erase(t1.root().begin(), t1.root().begin()+2);
+    CHECK_TREE(t1, data(), "0 4 6");
+    BOOST_CHECK_EQUAL(t1.root()[0].index_in_parent(), 0);
+    BOOST_CHECK_EQUAL(t1.root()[1].index_in_parent(), 1);
+
+    // swap and graft keep positions current
+    t1.root()[0].insert(7);
+    t1.root()[0].swap(t1.root()[1]);
+    CHECK_TREE(t1, data(), "0 6 4 7");
+    BOOST_CHECK_EQUAL(t1.root()[0].data(), 6);
+    BOOST_CHECK_EQUAL(t1.root()[0].index_in_parent(), 0);
+    BOOST_CHECK_EQUAL(t1.root()[1].index_in_parent(), 1);
+    t1.root()[1][0].swap(t1.root()[0]);
+    CHECK_TREE(t1, data(), "0 7 4 6");
+    BOOST_CHECK_EQUAL(t1.root()[1][0].index_in_parent(), 0);
+    t1.root().graft(t1.root()[1][0]);
+    t1.root()[0].graft(t1.root()[1]);
+    CHECK_TREE(t1, data(), "0 7 6 4");
+    BOOST_CHECK_EQUAL(t1.root()[1].index_in_parent(), 1);
+    BOOST_CHECK_EQUAL(t1.root()[0][0].index_in_parent(), 0);
+
+    // erasing every child of a wide node, one at a time, is linear
+    const size_t n = 100000;
+    tree<int> t2;
+    t2.insert(0);
+    for (size_t j = 0;  j < n;  ++j) t2.root().insert(int(j));
+    for (size_t j = 0;  j < n;  ++j) t2.root().back().erase();
+    BOOST_CHECK(t2.root().empty());
+    BOOST_CHECK_EQUAL(t2.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(cached_tree_and_ply) {
+    tree<int> t1;
+    t1.insert(0);
+    t1.root().insert(1);
+    t1.root()[0].insert(2);
+    tree<int> t2;
+    t2.insert(3);
+    t2.root().insert(4);
+    t2.root()[0].insert(5);
+
+    // a subtree moved across trees is re-stamped with its new tree and plies
+    t1.root()[0][0].graft(t2.root()[0]);
+    CHECK_TREE(t1, data(), "0 1 2 4 5");
+    CHECK_TREE(t1, ply(), "0 1 2 3 4");
+    BOOST_CHECK_EQUAL(&t1.root()[0][0][0][0].tree(), &t1);
+    CHECK_TREE(t2, ply(), "0");
+
+    // a moved or swapped tree carries its nodes along
+    tree<int> t3(std::move(t1));
+    BOOST_CHECK_EQUAL(&t3.root()[0][0][0][0].tree(), &t3);
+    t2.swap(t3);
+    BOOST_CHECK_EQUAL(&t2.root()[0][0][0][0].tree(), &t2);
+    BOOST_CHECK_EQUAL(&t3.root().tree(), &t3);
+
+    // a subtree that becomes a root starts again at ply 0
+    t3.insert(t2.root()[0][0]);
+    CHECK_TREE(t3, ply(), "0 1 2");
+    BOOST_CHECK_EQUAL(&t3.root()[0][0].tree(), &t3);
+}
+
+struct chain_visitor {
+    size_t deepest, exits;
+    chain_visitor() : deepest(0), exits(0) {}
+    template <typename Node> void enter(const Node&, size_t ply) { if (ply > deepest) deepest = ply; }
+    template <typename Node> void exit(const Node&, size_t) { exits += 1; }
+};
+
+BOOST_AUTO_TEST_CASE(deep_chain) {
+    // copying, comparing and destroying a linear chain must not recurse once per level
+    const size_t n = UT_DEEP_CHAIN;
+
+    // without bookkeeping to percolate, a chain grows at the leaf in O(1) per level
+    typedef tree<int, raw<>, std::allocator<int>, tracking<false, false> > untracked_t;
+    untracked_t t1;
+    t1.insert(0);
+    untracked_t::node_type* p = &t1.root();
+    for (size_t j = 1;  j < n;  ++j) p = &*p->insert(0);
+    BOOST_CHECK_EQUAL(p->ply(), n-1);
+    BOOST_CHECK_EQUAL(t1.size(), n);
+    BOOST_CHECK_EQUAL(t1.depth(), n);
+    chain_visitor cv;
+    visit(t1, cv);
+    BOOST_CHECK_EQUAL(cv.deepest, n-1);
+    BOOST_CHECK_EQUAL(cv.exits, n);
+
+    untracked_t t2(t1);
+    BOOST_CHECK_EQUAL(t2.size(), n);
+    BOOST_CHECK_EQUAL(t2.depth(), n);
+    BOOST_CHECK(t2 == t1);
+    BOOST_CHECK(!(t1 < t2));
+    BOOST_CHECK(!(t2 < t1));
+
+    untracked_t::node_type* q = &t2.root();
+    while (!q->empty()) q = &q->front();
+    BOOST_CHECK_EQUAL(q->ply(), n-1);
+    q->data() = 1;
+    BOOST_CHECK(t2 != t1);
+    BOOST_CHECK(t1 < t2);
+    BOOST_CHECK(!(t2 < t1));
+
+    t2.clear();
+    BOOST_CHECK(t2.empty());
+
+    // a tracked chain of the same depth, built in O(n) from its parent column
+    std::vector<long> par(n);
+    std::vector<int> dat(n, 0);
+    for (size_t j = 0;  j < n;  ++j) par[j] = long(j) - 1;
+    tree<int> t3;
+    t3.build_from_parents(par.begin(), par.end(), dat.begin());
+    BOOST_CHECK_EQUAL(t3.size(), n);
+    BOOST_CHECK_EQUAL(t3.depth(), n);
+    tree<int>::node_type* r = &t3.root();
+    while (!r->empty()) r = &r->front();
+    BOOST_CHECK_EQUAL(r->ply(), n-1);
+    BOOST_CHECK_EQUAL(&r->tree(), &t3);
+
+    tree<int> t4(t3);
+    BOOST_CHECK_EQUAL(t4.size(), n);
+    BOOST_CHECK_EQUAL(t4.depth(), n);
+    BOOST_CHECK(t4 == t3);
+    r = &t4.root();
+    while (!r->empty()) r = &r->front();
+    r->data() = 1;
+    BOOST_CHECK(t3 < t4);
+    t4.clear();
+    BOOST_CHECK(t4.empty());
+
+    // growing a tracked chain at its root moves the whole chain down a ply each time, and
+    // every move re-stamps the moved nodes: that build is quadratic, so it stays shallow
+    const size_t m = n / 500;
+    tree<int> t5;
+    t5.insert(0);
+    for (size_t j = 1;  j < m;  ++j) {
+        tree<int> t;
+        t.insert(0);
+        t.root().insert(std::move(t5));
+        t5 = std::move(t);
+    }
+    BOOST_CHECK_EQUAL(t5.size(), m);
+    BOOST_CHECK_EQUAL(t5.depth(), m);
+    BOOST_CHECK_EQUAL(t5.root().front().ply(), 1);
+}
+
+#if !defined(ST_TREE_VIRTUAL_DESTRUCTORS)
+BOOST_AUTO_TEST_CASE(non_virtual_layout) {
+    BOOST_CHECK(!std::is_polymorphic<tree<int>::node_type>::value);
+    BOOST_CHECK(!std::is_polymorphic<tree<int>::iterator>::value);
+    BOOST_CHECK(!std::is_polymorphic<tree<int>::df_pre_iterator>::value);
+    BOOST_CHECK(std::is_trivially_copyable<tree<int>::df_pre_iterator>::value);
+    BOOST_CHECK(std::is_trivially_copyable<tree<int>::const_df_post_iterator>::value);
+    BOOST_CHECK(std::is_trivially_copyable<st_tree::detail::ptr_less<std::less<int> > >::value);
+    BOOST_CHECK(std::is_trivially_copyable<tree<int>::node_type::iterator>::value);
+    BOOST_CHECK(std::is_trivially_copyable<tree<int>::node_type::const_iterator>::value);
+}
+#endif
+
+// counts live instances, to see when node data is destroyed
+struct tally {
+    static int live;
+    int v;
+    tally(int v_ = 0) : v(v_) { ++live; }
+    tally(const tally& src) : v(src.v) { ++live; }
+    ~tally() { --live; }
+    tally& operator=(const tally& src) { v = src.v;  return *this; }
+    bool operator==(const tally& rhs) const { return v == rhs.v; }
+    bool operator!=(const tally& rhs) const { return v != rhs.v; }
+    bool operator<(const tally& rhs) const { return v < rhs.v; }
+};
+int tally::live = 0;
+
+BOOST_AUTO_TEST_CASE(deferred_reclamation) {
+    typedef tree<tally> tree_t;
+    {
+        tree_t t1;
+        t1.insert(tally(0));
+        for (int j = 0;  j < 10;  ++j) {
+            t1.root().insert(tally(j));
+            for (int k = 0;  k < 10;  ++k) t1.root()[j].insert(tally(k));
+        }
+        BOOST_CHECK_EQUAL(tally::live, 111);
+        BOOST_CHECK(!t1.deferring_reclamation());
+
+        // erased subtrees are unlinked at once, and their sizes leave the tree, but their nodes linger
+        t1.defer_reclamation();
+        BOOST_CHECK(t1.deferring_reclamation());
+        t1.root().erase(t1.root().begin() + 2);
+        t1.root()[0].erase(t1.root()[0].begin(), t1.root()[0].begin() + 5);
+        t1.root()[1].pop_back();
+        BOOST_CHECK_EQUAL(t1.size(), 111 - 11 - 5 - 1);
+        BOOST_CHECK_EQUAL(t1.root().size(), 9);
+        BOOST_CHECK_EQUAL(t1.root()[2].data().v, 3);
+        BOOST_CHECK_EQUAL(tally::live, 111);
+        t1.flush();
+        BOOST_CHECK_EQUAL(tally::live, 111 - 11 - 5 - 1);
+        t1.flush();
+        BOOST_CHECK_EQUAL(tally::live, 111 - 11 - 5 - 1);
+
+        // clear() queues the whole tree, which can be refilled while the old one waits
+        t1.clear();
+        BOOST_CHECK(t1.empty());
+        BOOST_CHECK_EQUAL(tally::live, 111 - 11 - 5 - 1);
+        t1.insert(tally(5));
+        t1.root().insert(tally(6));
+        BOOST_CHECK_EQUAL(t1.size(), 2);
+        t1.flush();
+        BOOST_CHECK_EQUAL(tally::live, 2);
+
+        // turning deferral off releases synchronously again, and leaves the queue for flush()
+        t1.root().erase(t1.root().begin());
+        t1.defer_reclamation(false);
+        t1.insert(tally(7));
+        BOOST_CHECK_EQUAL(tally::live, 2);
+        t1.flush();
+        BOOST_CHECK_EQUAL(tally::live, 1);
+
+        // whatever is still queued is released along with the tree
+        t1.defer_reclamation();
+        t1.root().insert(tally(8));
+        t1.root().erase(t1.root().begin());
+        BOOST_CHECK_EQUAL(tally::live, 2);
+    }
+    BOOST_CHECK_EQUAL(tally::live, 0);
+}
+
+BOOST_AUTO_TEST_CASE(build_from_parents) {
+    tree<int> t1;
+    int par1[] = {-1, 0, 0, 1, 1, 2, 4};
+    int dat1[] = {0, 1, 2, 3, 4, 5, 6};
+    t1.build_from_parents(par1, par1 + 7, dat1);
+    CHECK_TREE(t1, data(), "0 1 2 3 4 5 6");
+    CHECK_TREE(t1, ply(), "0 1 1 2 2 2 3");
+    CHECK_TREE(t1, subtree_size(), "7 4 2 1 2 1 1");
+    CHECK_TREE(t1, depth(), "4 3 2 1 2 1 1");
+    BOOST_CHECK_EQUAL(t1.size(), 7);
+    BOOST_CHECK_EQUAL(t1.depth(), 4);
+    BOOST_CHECK_EQUAL(&t1.root()[0][1][0].tree(), &t1);
+
+    // the root can sit anywhere, and children keep the order of their indices
+    int par2[] = {3, 3, -1, 2, 0};
+    t1.build_from_parents(par2, par2 + 5, dat1);
+    CHECK_TREE(t1, data(), "2 3 0 1 4");
+    CHECK_TREE(t1, subtree_size(), "5 4 2 1 1");
+    BOOST_CHECK_EQUAL(t1.root()[0][1].index_in_parent(), 1);
+
+    // the result is an ordinary tree, the same as one grown a node at a time
+    tree<int> t2;
+    t2.insert(2);
+    t2.root().insert(3);
+    t2.root()[0].insert(0);
+    t2.root()[0].insert(1);
+    t2.root()[0][0].insert(4);
+    BOOST_CHECK(t1 == t2);
+    t1.root()[0][0].insert(9);
+    BOOST_CHECK_EQUAL(t1.size(), 6);
+    BOOST_CHECK_EQUAL(t1.depth(), 4);
+    t1.root()[0].erase(t1.root()[0].begin());
+    CHECK_TREE(t1, subtree_size(), "3 2 1");
+    CHECK_TREE(t1, depth(), "3 2 1");
+
+    // malformed columns are rejected, and leave the tree as it was
+    int two_roots[] = {-1, 0, -1};
+    BOOST_CHECK_THROW(t1.build_from_parents(two_roots, two_roots + 3, dat1), parent_exception);
+    int no_root[] = {1, 2, 0};
+    BOOST_CHECK_THROW(t1.build_from_parents(no_root, no_root + 3, dat1), cycle_exception);
+    int loop[] = {-1, 0, 3, 2};
+    BOOST_CHECK_THROW(t1.build_from_parents(loop, loop + 4, dat1), cycle_exception);
+    int self[] = {-1, 1};
+    BOOST_CHECK_THROW(t1.build_from_parents(self, self + 2, dat1), cycle_exception);
+    CHECK_TREE(t1, data(), "2 3 1");
+
+    t1.build_from_parents(par1, par1, dat1);
+    BOOST_CHECK(t1.empty());
+
+    // a larger tree, checked node by node against incremental construction
+    const int n = 20000;
+    std::vector<int> par(n);
+    std::vector<int> dat(n);
+    tree<int> t3;
+    std::vector<tree<int>::node_type*> nodes(n);
+    t3.insert(0);
+    nodes[0] = &t3.root();
+    par[0] = -1;
+    for (int i = 1;  i < n;  ++i) {
+        par[i] = (i * 7919) % i;
+        dat[i] = i;
+        nodes[i] = &*nodes[par[i]]->insert(i);
+    }
+    tree<int> t4;
+    t4.build_from_parents(par.begin(), par.end(), dat.begin());
+    BOOST_CHECK(t4 == t3);
+    BOOST_CHECK_EQUAL(t4.depth(), t3.depth());
+    tree<int>::df_pre_iterator j3(t3.df_pre_begin());
+    tree<int>::df_pre_iterator j4(t4.df_pre_begin());
+    bool same = true;
+    for (;  j3 != t3.df_pre_end();  ++j3, ++j4)
+        same = same && (j3->subtree_size() == j4->subtree_size()) && (j3->depth() == j4->depth()) && (j3->ply() == j4->ply());
+    BOOST_CHECK(same);
+
+    typedef tree<int, raw<>, std::allocator<int>, tracking<false, false> > untracked_t;
+    untracked_t t5;
+    t5.build_from_parents(par1, par1 + 7, dat1);
+    CHECK_TREE(t5, subtree_size(), "7 4 2 1 2 1 1");
+    CHECK_TREE(t5, depth(), "4 3 2 1 2 1 1");
+}
+
+BOOST_AUTO_TEST_CASE(build_from_edges) {
+    tree<string> t1;
+    string dat[] = {"r", "a", "b", "c", "d"};
+    std::vector<pair<int, int> > edges;
+    edges.push_back(pair<int, int>(0, 3));
+    edges.push_back(pair<int, int>(3, 4));
+    edges.push_back(pair<int, int>(0, 1));
+    edges.push_back(pair<int, int>(1, 2));
+    t1.build_from_edges(edges.begin(), edges.end(), dat, 5);
+    CHECK_TREE(t1, data(), "r a c b d");
+    CHECK_TREE(t1, subtree_size(), "5 2 2 1 1");
+    BOOST_CHECK_EQUAL(t1.depth(), 3);
+
+    edges.push_back(pair<int, int>(2, 4));
+    BOOST_CHECK_THROW(t1.build_from_edges(edges.begin(), edges.end(), dat, 5), parent_exception);
+    edges.back() = pair<int, int>(2, 5);
+    BOOST_CHECK_THROW(t1.build_from_edges(edges.begin(), edges.end(), dat, 5), missing_exception);
+    edges.pop_back();
+    BOOST_CHECK_THROW(t1.build_from_edges(edges.begin(), edges.end() - 1, dat, 5), parent_exception);
+    CHECK_TREE(t1, data(), "r a c b d");
+}
+
+BOOST_AUTO_TEST_CASE(builder_events) {
+    tree<int> t1;
+    t1.insert(-1);
+    {
+        tree_builder<tree<int> > b(t1);
+        b.begin_node(0);
+          b.begin_node(1);
+            b.begin_node(3);  b.end_node();
+            b.begin_node(4);
+              b.begin_node(6);  b.end_node();
+            b.end_node();
+          b.end_node();
+          b.begin_node(2);
+            b.begin_node(5);  b.end_node();
+        BOOST_CHECK_EQUAL(b.open(), 2);
+        // the target is untouched until the root closes
+        BOOST_CHECK_EQUAL(t1.size(), 1);
+          b.end_node();
+        b.end_node();
+        BOOST_CHECK_EQUAL(b.open(), 0);
+        BOOST_CHECK_THROW(b.end_node(), missing_exception);
+    }
+    CHECK_TREE(t1, data(), "0 1 2 3 4 5 6");
+    CHECK_TREE(t1, ply(), "0 1 1 2 2 2 3");
+    CHECK_TREE(t1, subtree_size(), "7 4 2 1 2 1 1");
+    CHECK_TREE(t1, depth(), "4 3 2 1 2 1 1");
+    BOOST_CHECK_EQUAL(&t1.root()[0][1][0].tree(), &t1);
+    t1.root()[1].insert(7);
+    BOOST_CHECK_EQUAL(t1.size(), 8);
+
+    // a builder abandoned mid-stream releases its nodes and leaves the target as it was
+    {
+        tree_builder<tree<int> > b(t1);
+        b.begin_node(10);
+        b.begin_node(11);
+    }
+    BOOST_CHECK_EQUAL(t1.size(), 8);
+
+    // a deep stream needs no recursion, and the same builder can go on to build again
+    const size_t n = 100000;
+    tree<int> t2;
+    tree_builder<tree<int> > b(t2);
+    for (size_t j = 0;  j < n;  ++j)  b.begin_node(int(j));
+    for (size_t j = 0;  j < n;  ++j)  b.end_node();
+    BOOST_CHECK_EQUAL(t2.size(), n);
+    BOOST_CHECK_EQUAL(t2.depth(), n);
+    b.begin_node(1);
+    b.begin_node(2);
+    b.end_node();
+    b.end_node();
+    CHECK_TREE(t2, data(), "1 2");
+
+    typedef tree<int, raw<>, std::allocator<int>, tracking<false, false> > untracked_t;
+    untracked_t t3;
+    tree_builder<untracked_t> b3(t3);
+    b3.begin_node(0);  b3.begin_node(1);  b3.begin_node(2);  b3.end_node();  b3.end_node();  b3.begin_node(3);  b3.end_node();  b3.end_node();
+    CHECK_TREE(t3, data(), "0 1 3 2");
+    CHECK_TREE(t3, subtree_size(), "4 2 1 1");
+    CHECK_TREE(t3, depth(), "3 2 1 1");
+}
+
+// true if every node's cached size and depth match a fresh count of its subtree
+template <typename Tree>
+bool bookkeeping_current(Tree& t) {
+    for (typename Tree::df_pre_iterator j(t.df_pre_begin());  j != t.df_pre_end();  ++j) {
+        size_t s = 0;
+        size_t h = 0;
+        for (typename Tree::node_type::df_pre_iterator k(j->df_pre_begin());  k != j->df_pre_end();  ++k) {
+            s += 1;
+            if (1 + k->ply() - j->ply() > h) h = 1 + k->ply() - j->ply();
+        }
+        if ((j->subtree_size() != s) || (j->depth() != h)) return false;
+    }
+    return true;
+}
+
+template <typename Tree>
+void batch_edits(Tree& t) {
+    t.insert(0);
+    for (int j = 0;  j < 10;  ++j) {
+        t.root().insert(j);
+        for (int k = 0;  k < 5;  ++k) t.root()[j].insert(k);
+    }
+    {
+        typename Tree::batch_scope b = t.begin_batch();
+        for (int j = 0;  j < 10;  ++j)  t.root()[3][2].insert(100 + j);
+        t.root()[3][2][4].insert(200);
+        t.root()[3][2][4][0].insert(201);
+        t.root()[0].erase(t.root()[0].begin(), t.root()[0].begin() + 2);
+        t.root()[1][0].graft(t.root()[2][1]);
+        t.root()[4].erase(t.root()[4].begin());
+        t.root()[5].pop_back();
+        // a nested batch does not settle anything on its own
+        {
+            typename Tree::batch_scope b2 = t.begin_batch();
+            t.root()[6][0].insert(300);
+            b2.commit();
+            BOOST_CHECK(!bookkeeping_current(t));
+        }
+    }
+    BOOST_CHECK(bookkeeping_current(t));
+    BOOST_CHECK_EQUAL(t.size(), 1 + 50 + 10 - 2 - 1 - 1 + 10 + 2 + 1);
+    BOOST_CHECK_EQUAL(t.depth(), 6);
+
+    // outside a batch, edits keep sizes current as before
+    t.root()[3].erase(t.root()[3].begin() + 2);
+    BOOST_CHECK(bookkeeping_current(t));
+    BOOST_CHECK_EQUAL(t.depth(), 4);
+
+    // a batch can erase a subtree it just grew
+    {
+        typename Tree::batch_scope b = t.begin_batch();
+        typename Tree::node_type& n = *t.root()[7].insert(400);
+        for (int j = 0;  j < 5;  ++j)  n.insert(j)->insert(j);
+        t.root()[7].erase(t.root()[7].begin() + 5);
+        t.root()[8].insert(500);
+    }
+    BOOST_CHECK(bookkeeping_current(t));
+}
+
+BOOST_AUTO_TEST_CASE(batched_bookkeeping) {
+    tree<int> t1;
+    batch_edits(t1);
+
+    tree<int, raw<>, std::allocator<int>, tracking<true, false> > t2;
+    batch_edits(t2);
+
+    tree<int, raw<>, std::allocator<int>, tracking<false, true> > t3;
+    batch_edits(t3);
+}
+
+BOOST_AUTO_TEST_CASE(batched_moves) {
+    tree<int> t1;
+    t1.insert(0);
+    for (int j = 0;  j < 8;  ++j) t1.root().insert(j)->insert(10 + j);
+    tree<int> t2;
+    t2.insert(100);
+    t2.root().insert(101);
+    tree<int> t3;
+    t3.insert(200);
+    {
+        tree<int>::batch_scope b = t1.begin_batch();
+        for (int j = 0;  j < 8;  ++j)  t1.root()[j][0].insert(20 + j);
+
+        // subtrees leaving the batch for a tree that is not batching arrive with current sizes
+        t2.root().graft(t1.root()[0]);
+        CHECK_TREE(t2, data(), "100 101 0 10 20");
+        BOOST_CHECK(bookkeeping_current(t2));
+        BOOST_CHECK_EQUAL(t2.size(), 5);
+
+        t2.root()[0].swap(t1.root()[0]);
+        CHECK_TREE(t2, data(), "100 1 0 11 10 21 20");
+        BOOST_CHECK(bookkeeping_current(t2));
+
+        t3.graft(t1.root()[0]);
+        CHECK_TREE(t3, data(), "101");
+        t3.graft(t1.root()[0]);
+        CHECK_TREE(t3, data(), "2 12 22");
+        BOOST_CHECK(bookkeeping_current(t3));
+        BOOST_CHECK_EQUAL(t3.size(), 3);
+
+        t3.root().insert(t1.root()[0]);
+        BOOST_CHECK(bookkeeping_current(t3));
+        BOOST_CHECK_EQUAL(t3.size(), 6);
+
+        tree<int> t4(t1);
+        BOOST_CHECK(bookkeeping_current(t4));
+        BOOST_CHECK_EQUAL(t4.size(), 1 + 5*3);
+
+        t4.swap(t1);
+        BOOST_CHECK(bookkeeping_current(t1));
+        BOOST_CHECK(bookkeeping_current(t4));
+        t4.swap(t1);
+
+        tree<int> t5(std::move(t4));
+        BOOST_CHECK(bookkeeping_current(t5));
+        BOOST_CHECK_EQUAL(t5.size(), 1 + 5*3);
+    }
+    BOOST_CHECK(bookkeeping_current(t1));
+    BOOST_CHECK_EQUAL(t1.size(), 1 + 5*3);
+
+    // so does a whole tree moved out of a batch
+    tree<int> t6;
+    {
+        tree<int>::batch_scope b = t1.begin_batch();
+        t1.root()[0][0].insert(30);
+        tree<int> t7(std::move(t1));
+        BOOST_CHECK(bookkeeping_current(t7));
+        BOOST_CHECK_EQUAL(t7.size(), 1 + 5*3 + 1);
+        t1 = std::move(t7);
+        t1.root()[1][0].insert(31);
+        t6 = std::move(t1);
+        BOOST_CHECK(bookkeeping_current(t6));
+        BOOST_CHECK_EQUAL(t6.size(), 1 + 5*3 + 2);
+    }
+    BOOST_CHECK(t1.empty());
+}
+
+BOOST_AUTO_TEST_CASE(insert_range) {
+    tree<int> t1;
+    t1.insert(0);
+    t1.root().insert(1);
+    int v[] = {5, 6, 7, 8};
+    t1.root()[0].insert(v, v + 4);
+    CHECK_TREE(t1, data(), "0 1 5 6 7 8");
+    CHECK_TREE(t1, subtree_size(), "6 5 1 1 1 1");
+    CHECK_TREE(t1, depth(), "3 2 1 1 1 1");
+    CHECK_TREE(t1, ply(), "0 1 2 2 2 2");
+    BOOST_CHECK_EQUAL(t1.root()[0][3].index_in_parent(), 3);
+    BOOST_CHECK_EQUAL(&t1.root()[0][3].parent(), &t1.root()[0]);
+
+    // single pass input, and an empty range
+    std::istringstream in("9 10");
+    t1.root().insert(std::istream_iterator<int>(in), std::istream_iterator<int>());
+    t1.root().insert(v, v);
+    CHECK_TREE(t1, data(), "0 1 9 10 5 6 7 8");
+    BOOST_CHECK_EQUAL(t1.size(), 8);
+
+    t1.root()[1].emplace_back_n(3, 4);
+    CHECK_TREE(t1, data(), "0 1 9 10 5 6 7 8 4 4 4");
+    BOOST_CHECK_EQUAL(t1.root()[1].subtree_size(), 4);
+    BOOST_CHECK_EQUAL(t1.size(), 11);
+    t1.root()[1].emplace_back_n(0, 4);
+    BOOST_CHECK_EQUAL(t1.size(), 11);
+
+    tree<string> t2;
+    t2.insert("r");
+    t2.root().emplace_back_n(2, 3, 'x');
+    CHECK_TREE(t2, data(), "r xxx xxx");
+    t2.root()[1].emplace_back_n(2);
+    BOOST_CHECK_EQUAL(t2.size(), 5);
+    BOOST_CHECK_EQUAL(t2.depth(), 3);
+
+    // inside a batch, the range is accounted for when the batch commits
+    {
+        tree<int>::batch_scope b = t1.begin_batch();
+        t1.root()[2].insert(v, v + 4);
+        t1.root()[2][0].emplace_back_n(5, 1);
+    }
+    BOOST_CHECK_EQUAL(t1.size(), 20);
+    BOOST_CHECK_EQUAL(t1.depth(), 4);
+    BOOST_CHECK_EQUAL(t1.root()[2].subtree_size(), 10);
+}
+
+BOOST_AUTO_TEST_CASE(erase_if_subtree) {
+    tree<int> t1;
+    t1.insert(0);
+    for (int j = 1;  j <= 6;  ++j) {
+        t1.root().insert(j);
+        for (int k = 1;  k <= 3;  ++k) t1.root()[j-1].insert(10*j + k);
+    }
+    t1.root()[1][1].insert(99);
+    BOOST_CHECK_EQUAL(t1.size(), 26);
+
+    // matches are erased with their subtrees, and nodes below a match are not tested
+    int tested = 0;
+    size_t m = erase_if(t1.root(), [&tested](const tree<int>::node_type& n) { ++tested;  return (n.data() % 2) == 1; });
+    BOOST_CHECK_EQUAL(m, 3 + 7);
+    BOOST_CHECK_EQUAL(tested, 6 + 10);
+    CHECK_TREE(t1, data(), "0 2 4 6 22 42 62");
+    CHECK_TREE(t1, subtree_size(), "7 2 2 2 1 1 1");
+    CHECK_TREE(t1, depth(), "3 2 2 2 1 1 1");
+    BOOST_CHECK_EQUAL(t1.root()[2].index_in_parent(), 2);
+    BOOST_CHECK_EQUAL(t1.root()[2][0].index_in_parent(), 0);
+    BOOST_CHECK(bookkeeping_current(t1));
+
+    // only the subtree at the given node is touched
+    m = erase_if(t1.root()[1], [](const tree<int>::node_type&) { return true; });
+    BOOST_CHECK_EQUAL(m, 1);
+    CHECK_TREE(t1, data(), "0 2 4 6 22 62");
+    BOOST_CHECK(bookkeeping_current(t1));
+
+    // a tree's root is tested as well
+    BOOST_CHECK_EQUAL(erase_if(t1, [](const tree<int>::node_type& n) { return n.data() == 6; }), 1);
+    CHECK_TREE(t1, data(), "0 2 4 22");
+    BOOST_CHECK_EQUAL(erase_if(t1, [](const tree<int>::node_type& n) { return n.data() == 0; }), 1);
+    BOOST_CHECK(t1.empty());
+    BOOST_CHECK_EQUAL(erase_if(t1, [](const tree<int>::node_type&) { return true; }), 0);
+
+    // a predicate that throws leaves a consistent tree behind
+    tree<int> t2;
+    t2.insert(0);
+    for (int j = 0;  j < 10;  ++j) t2.root().insert(j)->insert(j);
+    int calls = 0;
+    BOOST_CHECK_THROW(erase_if(t2.root(), [&calls](const tree<int>::node_type& n) {
+        if (++calls == 6) throw std::runtime_error("pred");
+        return (n.data() % 2) == 0;
+    }), std::runtime_error);
+    CHECK_TREE(t2, data(), "0 1 3 5 6 7 8 9 1 3 5 6 7 8 9");
+    for (int j = 0;  j < 7;  ++j)  BOOST_CHECK_EQUAL(t2.root()[j].index_in_parent(), size_t(j));
+    BOOST_CHECK(bookkeeping_current(t2));
+
+    // inside a batch, the bookkeeping waits for the commit
+    {
+        tree<int>::batch_scope b = t2.begin_batch();
+        erase_if(t2.root(), [](const tree<int>::node_type& n) { return n.data() > 6; });
+        t2.root().insert(10);
+    }
+    CHECK_TREE(t2, data(), "0 1 3 5 6 10 1 3 5 6");
+    BOOST_CHECK(bookkeeping_current(t2));
+
+    typedef tree<int, raw<>, std::allocator<int>, tracking<false, false> > untracked_t;
+    untracked_t t3;
+    t3.insert(0);
+    for (int j = 0;  j < 5;  ++j) t3.root().insert(j)->insert(j);
+    erase_if(t3, [](const untracked_t::node_type& n) { return (n.ply() == 2) && (n.data() < 3); });
+    CHECK_TREE(t3, data(), "0 0 1 2 3 4 3 4");
+    BOOST_CHECK_EQUAL(t3.depth(), 3);
+}
+
+BOOST_AUTO_TEST_CASE(erase_if_deep_subtree) {
+    // a narrow subtree under a wide root: only its own chain of ancestors changes
+    tree<int> t1;
+    t1.insert(0);
+    for (int j = 0;  j < 1000;  ++j) t1.root().insert(j);
+    tree<int>::node_type* q = &t1.root()[500];
+    for (int j = 1;  j <= 4;  ++j) {
+        q->insert(-j);
+        q = &*q->insert(j);
+    }
+    t1.root()[7].insert(7)->insert(7);
+    BOOST_CHECK_EQUAL(t1.size(), 1 + 1000 + 8 + 2);
+    BOOST_CHECK_EQUAL(t1.depth(), 6);
+
+    // the tallest branch shrinks, which the root's height follows
+    tree<int>::node_type& n = t1.root()[500];
+    BOOST_CHECK_EQUAL(erase_if(n, [](const tree<int>::node_type& c) { return c.data() == 3; }), 1);
+    BOOST_CHECK_EQUAL(n.subtree_size(), 6);
+    BOOST_CHECK_EQUAL(n.depth(), 4);
+    BOOST_CHECK_EQUAL(t1.size(), 1 + 1000 + 5 + 2);
+    BOOST_CHECK_EQUAL(t1.depth(), 5);
+    BOOST_CHECK(bookkeeping_current(t1));
+
+    // a branch shorter than its siblings leaves the heights above it alone
+    BOOST_CHECK_EQUAL(erase_if(n, [](const tree<int>::node_type& c) { return c.data() == -2; }), 1);
+    BOOST_CHECK_EQUAL(n.depth(), 4);
+    BOOST_CHECK_EQUAL(t1.size(), 1 + 1000 + 4 + 2);
+    BOOST_CHECK_EQUAL(t1.depth(), 5);
+    BOOST_CHECK(bookkeeping_current(t1));
+
+    // nothing matched, nothing changed
+    BOOST_CHECK_EQUAL(erase_if(n, [](const tree<int>::node_type&) { return false; }), 0);
+    BOOST_CHECK(bookkeeping_current(t1));
+
+    // a predicate that throws part way down still leaves the ancestors current
+    int calls = 0;
+    BOOST_CHECK_THROW(erase_if(n, [&calls](const tree<int>::node_type& c) {
+        if (++calls == 3) throw std::runtime_error("pred");
+        return c.data() == -1;
+    }), std::runtime_error);
+    BOOST_CHECK_EQUAL(n.subtree_size(), 4);
+    BOOST_CHECK_EQUAL(t1.size(), 1 + 1000 + 3 + 2);
+    BOOST_CHECK_EQUAL(t1.depth(), 5);
+    BOOST_CHECK(bookkeeping_current(t1));
+}
+
 BOOST_AUTO_TEST_SUITE_END()